@@ -182,7 +182,8 @@ timer_interrupt (struct intr_frame *args UNUSED)
 	thread_check_awake(ticks);
 
 #ifdef FILESYS
-	clock_algorithm_for_buffer_cache_arr(ticks);
+	if (ticks % TIMER_FREQ == 0)
+		wake_dirty_buffer_cache_writer();
 #endif
 
 	if(thread_mlfqs){
@@ -1,230 +1,883 @@
 #include "limits.h"
 #include "round.h"
+#include "stdlib.h"
 #include "string.h"
 #include "devices/timer.h"
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/thread.h"
 #include "threads/vaddr.h"
 #include "threads/palloc.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
 
+/* Protects the sector index and the bookkeeping fields of every
+   slot (sector_idx, state, pin_cnt and the replacement counters).
+   It is never held across disk I/O; slot contents are protected
+   by each slot's own lock instead, and is_dirty may be set by
+   anybody holding a pin. */
 static struct lock buffer_cache_lock;
+
+static struct buffer_cache_stats buffer_cache_stats;
+
+/* Next virtual sector number to hand out.  Protected by
+   buffer_cache_lock. */
+static block_sector_t buffer_cache_next_virtual = BUFFER_CACHE_VIRTUAL_SECTOR;
+
+/* Broadcast whenever a slot leaves BC_LOADING or BC_EVICTING, or
+   drops its last pin, so that waiters can look again. */
+static struct condition buffer_cache_changed;
+
 static struct buffer_cache* buffer_cache_arr;
 
+/* Number of slots in buffer_cache_arr. */
+static int buffer_cache_size = BUFFER_CACHE_ARR_SIZE;
+
+/* Empty slots, and the 2Q queues of valid ones.  Each list runs
+   from most to least recently inserted or used.  Protected by
+   buffer_cache_lock. */
+static struct list buffer_cache_free_list;
+static struct list buffer_cache_a1in;
+static struct list buffer_cache_am;
+static int buffer_cache_a1in_cnt;
+
+/* A sector recently replaced from A1in.  The entries live in a
+   fixed array and are recycled oldest first. */
+struct buffer_cache_ghost {
+	block_sector_t sector_idx;
+	struct list_elem fifo_elem;         /* Element in A1out. */
+	struct list_elem hash_elem;         /* Element in ghost hash bucket. */
+};
+
+/* A1out ghost list, newest first, indexed by sector through its
+   own buckets, and the array its entries come from.  Protected by
+   buffer_cache_lock. */
+static struct buffer_cache_ghost* buffer_cache_ghost_arr;
+static int buffer_cache_ghost_size, buffer_cache_ghost_cnt;
+static struct list buffer_cache_a1out;
+static struct list* buffer_cache_ghost_hash;
+
+/* Slots with is_dirty set, in the order they were dirtied, and
+   how many there are, and how many of those have in_txn set.
+   Protected by buffer_cache_lock. */
+static struct list buffer_cache_dirty_list;
+static int buffer_cache_dirty_cnt;
+static int buffer_cache_txn_cnt;
+
+/* Held by write_dirty_buffer_cache_to_sector() and
+   write_owned_buffer_cache_to_sector() throughout, so that passes
+   do not overlap. */
+static struct lock buffer_cache_flush_lock;
+
+/* The dirty writer sleeps on this semaphore.  It is upped once a
+   period from the timer interrupt and whenever the dirty ratio is
+   crossed; writer_woken keeps those from piling up. */
+static struct semaphore buffer_cache_writer_sema;
+static bool buffer_cache_writer_woken;
+
+/* Sector index over buffer_cache_arr, chained by hash_elem.
+   The bucket count is a power of two at least twice the number
+   of slots, so a lookup touches about one entry.  The ghost
+   buckets have the same count. */
+static struct list* buffer_cache_hash;
+static unsigned buffer_cache_hash_size;
+
+/* Sectors queued for the read-ahead thread, a ring buffer
+   protected by read_ahead_lock.  Requests that find the ring full
+   are dropped: read-ahead is only a hint. */
+static block_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static int read_ahead_head, read_ahead_cnt;
+static struct lock read_ahead_lock;
+static struct condition read_ahead_ready;
+
+static struct list* buffer_cache_bucket(block_sector_t);
+static struct list* buffer_cache_ghost_bucket(block_sector_t);
+static void enqueue_buffer_cache(struct buffer_cache*);
+static void remember_buffer_cache_ghost(block_sector_t);
+static bool forget_buffer_cache_ghost(block_sector_t);
+static struct buffer_cache* choose_victim_in_queue(struct list*, bool);
+static struct buffer_cache* choose_victim_in_queues(bool);
+static struct buffer_cache* lookup_buffer_cache(block_sector_t);
+/* How get_buffer_cache_from_sector() is to fill a slot. */
+enum buffer_cache_get {
+	BC_GET_DEMAND,                      /* Read the sector, count an access. */
+	BC_GET_PREFETCH,                    /* Read it unless cached, no access. */
+	BC_GET_NEW                          /* Newly allocated: zero, no read. */
+};
+
+static struct buffer_cache* get_buffer_cache_from_sector(block_sector_t, enum buffer_cache_get, enum buffer_cache_class);
+
+/* Which dirty slots collect_dirty_buffer_cache() is to pick. */
+enum buffer_cache_collect {
+	BC_COLLECT_ALL,                     /* Every one. */
+	BC_COLLECT_OWNED,                   /* Data of one file. */
+	BC_COLLECT_FRESH                    /* Sectors allocated since the last commit. */
+};
+
+static void acquire_buffer_cache_lock(struct lock*);
+static void clean_buffer_cache(struct buffer_cache*);
+static void join_journal_buffer_cache(struct buffer_cache*);
+static int compare_buffer_cache_sector(const void*, const void*);
+static void drop_buffer_cache(block_sector_t);
+static int collect_dirty_buffer_cache(struct buffer_cache**, enum buffer_cache_collect, block_sector_t);
+static void write_back_buffer_cache(struct buffer_cache**, int, char*, unsigned long long*);
+static void wait_for_buffer_cache_writes(void);
+
+/* Sets the number of slots to SIZE.  Must be called before
+   buffer_cache_init(). */
+void
+buffer_cache_configure(int size){
+	ASSERT(buffer_cache_arr == NULL);
+
+	if (size < BUFFER_CACHE_MIN_SIZE)
+		size = BUFFER_CACHE_MIN_SIZE;
+	buffer_cache_size = size;
+}
+
+int
+get_buffer_cache_size(void){
+	return buffer_cache_size;
+}
+
 void
 buffer_cache_init(void){
-	int bc_arr_size_bytes = sizeof (struct buffer_cache) * BUFFER_CACHE_ARR_SIZE;
+	int bc_arr_size_bytes = sizeof (struct buffer_cache) * buffer_cache_size;
 	int bc_arr_size_pages = DIV_ROUND_UP (bc_arr_size_bytes, PGSIZE);
 
+	/* Ready before buffer_cache_arr is set, which is what lets the
+		 timer interrupt wake the writer. */
+	sema_init(&buffer_cache_writer_sema, 0);
+
 	buffer_cache_arr = palloc_get_multiple(PAL_ZERO, bc_arr_size_pages);
+	if (buffer_cache_arr == NULL)
+		PANIC("failed to allocate buffer cache of %d sectors\n", buffer_cache_size);
+
+	unsigned i;
+	buffer_cache_hash_size = 1;
+	while (buffer_cache_hash_size < 2 * (unsigned) buffer_cache_size)
+		buffer_cache_hash_size <<= 1;
+	buffer_cache_hash = malloc(sizeof(struct list) * buffer_cache_hash_size);
+	buffer_cache_ghost_hash = malloc(sizeof(struct list) * buffer_cache_hash_size);
+	if (buffer_cache_hash == NULL || buffer_cache_ghost_hash == NULL)
+		PANIC("failed to allocate buffer cache hash\n");
+	for (i = 0; i < buffer_cache_hash_size; i++) {
+		list_init(buffer_cache_hash + i);
+		list_init(buffer_cache_ghost_hash + i);
+	}
+
+	buffer_cache_ghost_size = buffer_cache_size * BUFFER_CACHE_A1OUT_RATIO / 100;
+	buffer_cache_ghost_arr = malloc(sizeof(struct buffer_cache_ghost) * buffer_cache_ghost_size);
+	if (buffer_cache_ghost_arr == NULL)
+		PANIC("failed to allocate buffer cache ghost list\n");
+	list_init(&buffer_cache_a1out);
+
+	list_init(&buffer_cache_free_list);
+	list_init(&buffer_cache_a1in);
+	list_init(&buffer_cache_am);
+	for (i = 0; i < (unsigned) buffer_cache_size; i++) {
+		lock_init(&buffer_cache_arr[i].lock);
+		list_push_back(&buffer_cache_free_list, &buffer_cache_arr[i].queue_elem);
+	}
 
 	printf("buffer cache is initialized\n");
 	printf("bc size: %d, bc page size: %d, bc_arr addr: %p\n", bc_arr_size_bytes, bc_arr_size_pages, buffer_cache_arr);
 
 	lock_init(&buffer_cache_lock);
+	lock_init(&buffer_cache_flush_lock);
+	cond_init(&buffer_cache_changed);
+	list_init(&buffer_cache_dirty_list);
+
+	lock_init(&read_ahead_lock);
+	cond_init(&read_ahead_ready);
 }
 
 
+/* Returns the slot caching SECTOR_IDX, reading it from disk if
+   needed, and pins it so that it cannot be evicted.  The caller
+   must call unpin_buffer_cache() when done, after
+   set_buffer_cache_dirty() if it modified bc->data.  Holding
+   bc->lock while touching bc->data keeps concurrent copies of the
+   same sector consistent.
+
+   Disk I/O is done without buffer_cache_lock held: a slot being
+   read in is marked BC_LOADING and one whose dirty contents are
+   being written back is marked BC_EVICTING, and other threads
+   that want either sector wait for the state to change. */
+struct buffer_cache*
+pin_buffer_cache_from_sector(block_sector_t sector_idx, enum buffer_cache_class class){
+	return get_buffer_cache_from_sector(sector_idx, BC_GET_DEMAND, class);
+}
+
+/* Like pin_buffer_cache_from_sector(), for a sector that was just
+   allocated and whose old contents do not matter: the slot is
+   zeroed and marked dirty instead of being read from disk. */
 struct buffer_cache*
-get_buffer_cache_value_from_sector(block_sector_t sector_idx){
-	struct buffer_cache* ret=malloc(sizeof(struct buffer_cache));
+pin_new_buffer_cache_from_sector(block_sector_t sector_idx, enum buffer_cache_class class){
+	struct buffer_cache* bc = get_buffer_cache_from_sector(sector_idx, BC_GET_NEW, class);
+
+	lock_acquire(&bc->lock);
+	memset(bc->data, 0, BLOCK_SECTOR_SIZE);
+	lock_release(&bc->lock);
+	set_buffer_cache_dirty(bc);
+
+	return bc;
+}
+
+/* Brings SECTOR_IDX into the cache without pinning it.  Unlike a
+   demand load, this never counts as a reference, so prefetched
+   sectors stay on A1in and are replaced first if nobody reads
+   them again. */
+void
+prefetch_buffer_cache_from_sector(block_sector_t sector_idx){
+	struct buffer_cache* bc = get_buffer_cache_from_sector(sector_idx, BC_GET_PREFETCH, BC_CLASS_DATA);
+
+	if (bc != NULL)
+		unpin_buffer_cache(bc);
+}
+
+/* Does the work for pin_buffer_cache_from_sector().  With
+   BC_GET_PREFETCH, returns a null pointer without doing anything
+   when SECTOR_IDX is already cached, and otherwise loads it without
+   counting an access.  With BC_GET_NEW, a slot that has to be
+   loaded is zeroed instead of read.  CLASS is counted in the
+   statistics and recorded in the slot, where anything but
+   BC_CLASS_DATA makes set_buffer_cache_dirty() add the slot to the
+   journal transaction, so metadata must never be pinned as data. */
+static struct buffer_cache*
+get_buffer_cache_from_sector(block_sector_t sector_idx, enum buffer_cache_get how, enum buffer_cache_class class){
+	bool prefetch = how == BC_GET_PREFETCH;
+	struct buffer_cache* bc;
+	bool counted = how != BC_GET_DEMAND;
+
+	acquire_buffer_cache_lock(&buffer_cache_lock);
 
-	lock_acquire(&buffer_cache_lock);
+	while (true) {
+		bc = prefetch ? lookup_buffer_cache(sector_idx) : is_in_buffer_cache_arr(sector_idx);
+		if (bc != NULL && prefetch) {
+			bc = NULL;
+			break;
+		}
+		if (bc != NULL) {
+			if (bc->state == BC_EVICTING) {
+				cond_wait(&buffer_cache_changed, &buffer_cache_lock);
+				continue;
+			}
+
+			if (!counted) {
+				buffer_cache_stats.hits++;
+				buffer_cache_stats.class_hits[class]++;
+			}
+			bc->pin_cnt++;
+			bc->class = class;
+			while (bc->state == BC_LOADING)
+				cond_wait(&buffer_cache_changed, &buffer_cache_lock);
+			break;
+		}
+
+		bc = find_empty_in_buffer_cache_arr();
+		if (bc == NULL)
+			bc = choose_victim_in_buffer_cache_arr();
+		if (bc == NULL) {
+			/* Every slot is pinned or busy; wait for one to free up. */
+			cond_wait(&buffer_cache_changed, &buffer_cache_lock);
+			continue;
+		}
+
+		if (!counted) {
+			buffer_cache_stats.misses++;
+			buffer_cache_stats.class_misses[class]++;
+			counted = true;
+		}
+		if (bc->state == BC_VALID)
+			buffer_cache_stats.evictions++;
+
+		if (bc->state == BC_VALID && bc->is_dirty) {
+			/* Write the victim back, then start over: somebody may
+				 have loaded SECTOR_IDX while we were not looking. */
+			bc->state = BC_EVICTING;
+			bc->writing = true;
+			clean_buffer_cache(bc);
+			lock_release(&buffer_cache_lock);
+			block_write(fs_device, bc->sector_idx, bc->data);
+			acquire_buffer_cache_lock(&buffer_cache_lock);
+			buffer_cache_stats.eviction_writes++;
+			bc->writing = false;
+
+			list_remove(&bc->hash_elem);
+			bc->state = BC_EMPTY;
+			list_push_front(&buffer_cache_free_list, &bc->queue_elem);
+			cond_broadcast(&buffer_cache_changed, &buffer_cache_lock);
+			continue;
+		}
+
+		if (bc->state == BC_VALID)
+			list_remove(&bc->hash_elem);
+
+#ifdef INFO5
+		printf("sector idx %d will be written to buffer cache at bc:%p\n", sector_idx, bc);
+#endif
+		bc->sector_idx = sector_idx;
+		bc->state = BC_LOADING;
+		bc->is_dirty = false;
+		bc->in_txn = false;
+		bc->fresh = false;
+		bc->class = class;
+		bc->owner = 0;
+		bc->pin_cnt = 1;
+		list_push_front(buffer_cache_bucket(sector_idx), &bc->hash_elem);
+
+		/* A sector missed again shortly after leaving A1in has
+			 proven it is reused; everything else starts on A1in. */
+		bc->queue = !prefetch && forget_buffer_cache_ghost(sector_idx)
+								? BC_QUEUE_AM : BC_QUEUE_A1IN;
+		enqueue_buffer_cache(bc);
+
+		if (how == BC_GET_NEW)
+			memset(bc->data, 0, BLOCK_SECTOR_SIZE);
+		else {
+			lock_release(&buffer_cache_lock);
+			block_read(fs_device, sector_idx, bc->data);
+			acquire_buffer_cache_lock(&buffer_cache_lock);
+		}
+
+		bc->state = BC_VALID;
+		cond_broadcast(&buffer_cache_changed, &buffer_cache_lock);
+		break;
+	}
+
+	/* A new sector's contents only reach the disk through the cache,
+		 and must do so before the metadata that allocated it. */
+	if (how == BC_GET_NEW)
+		bc->fresh = true;
 
-  struct buffer_cache* bc = get_buffer_cache_from_sector(sector_idx);
 #ifdef INFO11
-	printf("get_buffer_cache_value sector_idx:%d, bc: %p, ret:%p\n", sector_idx, bc, ret);
+	printf("pin_buffer_cache sector_idx:%d, bc: %p\n", sector_idx, bc);
 #endif
-	memcpy(ret, bc, sizeof(struct buffer_cache));
 
 	lock_release(&buffer_cache_lock);
 
-	return ret;
+	return bc;
+}
+
+void
+unpin_buffer_cache(struct buffer_cache* bc){
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+
+	ASSERT(bc->pin_cnt > 0);
+	if (--bc->pin_cnt == 0)
+		cond_broadcast(&buffer_cache_changed, &buffer_cache_lock);
+
+	lock_release(&buffer_cache_lock);
+}
+
+/* Marks pinned slot BC as modified, putting it on the dirty list
+   and waking the writer early if too much of the cache is dirty.
+   Modified metadata joins the running journal transaction. */
+void
+set_buffer_cache_dirty(struct buffer_cache* bc){
+	ASSERT(bc->pin_cnt > 0);
+
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+
+	if (!bc->is_dirty) {
+		bc->is_dirty = true;
+		list_push_back(&buffer_cache_dirty_list, &bc->dirty_elem);
+		buffer_cache_dirty_cnt++;
+
+		if (buffer_cache_dirty_cnt * 100 >= buffer_cache_size * BUFFER_CACHE_DIRTY_RATIO)
+			wake_dirty_buffer_cache_writer();
+	}
+
+	join_journal_buffer_cache(bc);
+
+	lock_release(&buffer_cache_lock);
+}
+
+/* Adds dirty metadata slot BC to the running journal transaction,
+   waking the writer once that is half as large as one commit can
+   be.  A slot at a virtual sector has no home to log yet; it joins
+   when rename_buffer_cache() gives it one.  Must be called with
+   buffer_cache_lock held. */
+static void
+join_journal_buffer_cache(struct buffer_cache* bc){
+	if (bc->in_txn || !bc->is_dirty || bc->class == BC_CLASS_DATA
+			|| is_virtual_sector(bc->sector_idx) || !journal_active())
+		return;
+
+	bc->in_txn = true;
+	if (++buffer_cache_txn_cnt >= JOURNAL_BLOCKS_MAX / 2)
+		wake_dirty_buffer_cache_writer();
+}
+
+/* Takes BC off the dirty list and out of the journal transaction.
+   Must be called with buffer_cache_lock held. */
+static void
+clean_buffer_cache(struct buffer_cache* bc){
+	bc->fresh = false;
+	if (bc->is_dirty) {
+		bc->is_dirty = false;
+		list_remove(&bc->dirty_elem);
+		buffer_cache_dirty_cnt--;
+	}
+	if (bc->in_txn) {
+		bc->in_txn = false;
+		buffer_cache_txn_cnt--;
+	}
+}
+
+void
+write_src_to_buffer_cache_from_sector(block_sector_t sector_idx, int sector_ofs, const void* src, int size, enum buffer_cache_class class){
+	write_src_to_owned_buffer_cache_from_sector(sector_idx, sector_ofs, src, size, class, 0);
 }
 
+/* Like write_src_to_buffer_cache_from_sector(), for data of the file
+   whose inode is at OWNER, so that write_owned_buffer_cache_to_sector()
+   can find it.  An OWNER of 0 leaves the slot's owner as it was. */
 void
-write_src_to_buffer_cache_from_sector(block_sector_t sector_idx, int sector_ofs, const void* src, int size){
+write_src_to_owned_buffer_cache_from_sector(block_sector_t sector_idx, int sector_ofs, const void* src, int size, enum buffer_cache_class class, block_sector_t owner){
 	if (size-sector_ofs > BLOCK_SECTOR_SIZE)
-		PANIC("size-sector_ofs should be smaller than BLOCK_SECTOR_SIZE\n");		
+		PANIC("size-sector_ofs should be smaller than BLOCK_SECTOR_SIZE\n");
 
-	lock_acquire(&buffer_cache_lock);
+  struct buffer_cache* bc = pin_buffer_cache_from_sector(sector_idx, class);
 
-  struct buffer_cache* bc = get_buffer_cache_from_sector(sector_idx);
+	acquire_buffer_cache_lock(&bc->lock);
 	memcpy(bc->data + sector_ofs ,src ,size);
-	bc->is_dirty=true;
+	if (owner != 0)
+		bc->owner = owner;
+	set_buffer_cache_dirty(bc);
+	lock_release(&bc->lock);
 
 #ifdef INFO7
 	printf("write_src_buffer_cache_from sector_idx:%d, bc:%p\n", sector_idx, bc);
 #endif
 
+	unpin_buffer_cache(bc);
+}
+
+void
+read_buffer_cache_to_dst_from_sector(block_sector_t sector_idx, int sector_ofs, void* dst, int size, enum buffer_cache_class class){
+	if (size+sector_ofs > BLOCK_SECTOR_SIZE)
+		PANIC("size+sector_ofs should not be larger than BLOCK_SECTOR_SIZE\n");
+
+  struct buffer_cache* bc = pin_buffer_cache_from_sector(sector_idx, class);
+
+	acquire_buffer_cache_lock(&bc->lock);
+	memcpy(dst, bc->data + sector_ofs, size);
+	lock_release(&bc->lock);
+
+	unpin_buffer_cache(bc);
+}
+
+/* Returns a sector number that is not on disk, for caching data
+   that has no sector allocated yet.  The slot is created with
+   pin_new_buffer_cache_from_sector(). */
+block_sector_t
+new_virtual_buffer_cache_sector(void){
+	block_sector_t sector_idx;
+
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	sector_idx = buffer_cache_next_virtual++;
+	if (buffer_cache_next_virtual == BUFFER_CACHE_VIRTUAL_END)
+		buffer_cache_next_virtual = BUFFER_CACHE_VIRTUAL_SECTOR;
 	lock_release(&buffer_cache_lock);
+
+	return sector_idx;
 }
 
-struct buffer_cache*
-get_buffer_cache_from_sector(block_sector_t sector_idx){
-  struct buffer_cache* bc = is_in_buffer_cache_arr(sector_idx);
+/* Makes the cached virtual sector FROM become sector TO, which was
+   just allocated, so that its data gets written there.  A stale
+   copy of TO left over from before TO was last freed is dropped.
+   FROM may be pinned; its readers are not disturbed.  Metadata,
+   such as a directory block, joins the journal transaction now
+   that it has a home. */
+void
+rename_buffer_cache(block_sector_t from, block_sector_t to){
+	struct buffer_cache* bc;
 
-  if (bc == NULL){
-    bc = write_in_buffer_cache_arr(sector_idx);
-  }
+	ASSERT(is_virtual_sector(from));
+	ASSERT(!is_virtual_sector(to));
 
-	return bc;
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	drop_buffer_cache(to);
+
+	bc = lookup_buffer_cache(from);
+	ASSERT(bc != NULL);
+	list_remove(&bc->hash_elem);
+	bc->sector_idx = to;
+	list_push_front(buffer_cache_bucket(to), &bc->hash_elem);
+	bc->fresh = true;
+	join_journal_buffer_cache(bc);
+	lock_release(&buffer_cache_lock);
 }
 
-struct buffer_cache*
-is_in_buffer_cache_arr(block_sector_t sector_idx){
-	int i=0;
-	struct buffer_cache* bc=NULL, *bc_return=NULL;
-
-	for (i = 0; i < BUFFER_CACHE_ARR_SIZE; i++) {
-		bc = buffer_cache_arr + i;
-		if (bc->sector_idx == sector_idx && bc->is_used==true) {
-			bc->is_accessed=true;
-			bc->access_cnt++;
-#ifdef INFO
-			printf("found sector_idx %d at buffer cache i %d\n", sector_idx, i);
-#endif
-			bc_return=bc;
-			break;
-		}
+/* Throws away the cached copy of SECTOR_IDX, if any, without
+   writing it back.  Used for virtual sectors of a deleted file. */
+void
+discard_buffer_cache(block_sector_t sector_idx){
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	drop_buffer_cache(sector_idx);
+	lock_release(&buffer_cache_lock);
+}
+
+/* Does the work for discard_buffer_cache(), waiting for the slot to
+   be unpinned and idle first.  Must be called with
+   buffer_cache_lock held. */
+static void
+drop_buffer_cache(block_sector_t sector_idx){
+	struct buffer_cache* bc;
+
+	while ((bc = lookup_buffer_cache(sector_idx)) != NULL
+				 && (bc->pin_cnt > 0 || bc->state != BC_VALID))
+		cond_wait(&buffer_cache_changed, &buffer_cache_lock);
+	if (bc == NULL)
+		return;
+
+	clean_buffer_cache(bc);
+	list_remove(&bc->hash_elem);
+	list_remove(&bc->queue_elem);
+	if (bc->queue == BC_QUEUE_A1IN)
+		buffer_cache_a1in_cnt--;
+	bc->queue = BC_QUEUE_NONE;
+	bc->state = BC_EMPTY;
+	list_push_front(&buffer_cache_free_list, &bc->queue_elem);
+	cond_broadcast(&buffer_cache_changed, &buffer_cache_lock);
+}
+
+/* Acquires LOCK, which is buffer_cache_lock or a slot lock, and
+   accounts for the time spent waiting if somebody else held it.
+   The counters are shared by all locks, so they are only updated
+   under buffer_cache_lock.  A slot lock may be held while taking
+   buffer_cache_lock, never the other way around. */
+static void
+acquire_buffer_cache_lock(struct lock* lock){
+	if (lock->holder == NULL) {
+		lock_acquire(lock);
+		return;
 	}
 
-#ifdef INFO5
-	for (i = 0; i < BUFFER_CACHE_ARR_SIZE; i++) {
-		bc = buffer_cache_arr + i;
-		if (bc->sector_idx ==0 && bc->is_used==true){
-			if (((int*)bc->data)[0] != 512 ){
-				printf("sector 0 length %d\n", ((int*)bc->data)[0]);
-				PANIC("fuck");
-			}
-		}
+	int64_t start = timer_ticks();
+	lock_acquire(lock);
+	int64_t waited = timer_elapsed(start);
+
+	if (lock != &buffer_cache_lock)
+		lock_acquire(&buffer_cache_lock);
+	buffer_cache_stats.lock_waits++;
+	buffer_cache_stats.lock_wait_ticks += waited;
+	if (lock != &buffer_cache_lock)
+		lock_release(&buffer_cache_lock);
+}
+
+/* Pins up to MAX slots of the running journal transaction, stores
+   them into SLOTS in ascending sector order and returns how many
+   there were.  journal_commit() writes them and then hands them to
+   release_journal_buffer_cache().  Virtual slots never join the
+   transaction, but are passed over all the same, since logging one
+   would write past the end of the disk. */
+int
+collect_journal_buffer_cache(struct buffer_cache** slots, int max){
+	struct list_elem* e;
+	struct buffer_cache* bc;
+	int cnt = 0;
+
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	for (e = list_begin(&buffer_cache_dirty_list);
+			 e != list_end(&buffer_cache_dirty_list) && cnt < max; e = list_next(e)) {
+		bc = list_entry(e, struct buffer_cache, dirty_elem);
+		if (!bc->in_txn || is_virtual_sector(bc->sector_idx))
+			continue;
+		bc->pin_cnt++;
+		slots[cnt++] = bc;
 	}
-#endif
+	lock_release(&buffer_cache_lock);
 
-	return bc_return;
+	qsort(slots, cnt, sizeof *slots, compare_buffer_cache_sector);
+	return cnt;
 }
 
-struct buffer_cache*
-write_in_buffer_cache_arr(block_sector_t sector_idx) {
-	int idx = find_empty_in_buffer_cache_arr();
-	struct buffer_cache* bc = buffer_cache_arr + idx;
+/* Marks the CNT slots in SLOTS, collected by
+   collect_journal_buffer_cache() and since written home, clean and
+   unpins them. */
+void
+release_journal_buffer_cache(struct buffer_cache** slots, int cnt){
+	int i;
+
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	for (i = 0; i < cnt; i++) {
+		ASSERT(slots[i]->pin_cnt > 0);
+		clean_buffer_cache(slots[i]);
+		slots[i]->pin_cnt--;
+	}
+	cond_broadcast(&buffer_cache_changed, &buffer_cache_lock);
+	lock_release(&buffer_cache_lock);
+}
 
-#ifdef INFO5
-	printf("sector idx %d will be written to buffer cache to idx %d, bc:%p\n", sector_idx, idx, bc);
-#endif
+/* Returns the number of slots in the running journal
+   transaction. */
+int
+count_journal_buffer_cache(void){
+	int cnt;
 
-	bc->sector_idx = sector_idx;
-	bc->is_used = true;
-	bc->is_accessed = true;
-	bc->is_dirty = false;
-	bc->access_cnt = 1;
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	cnt = buffer_cache_txn_cnt;
+	lock_release(&buffer_cache_lock);
 
-#ifdef INFO5
-	int i=0;
-	if (sector_idx==0){
-		for (i=0; i<128; i++){
-			printf("%d ", ((int*)(bc->data))[i]);
-		}
-		printf("\nis before\n");
-	}
-#endif
+	return cnt;
+}
+
+/* Copies the current counters, and the number of dirty slots,
+   into STATS. */
+void
+get_buffer_cache_stats(struct buffer_cache_stats* stats){
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	*stats = buffer_cache_stats;
+	stats->dirty = buffer_cache_dirty_cnt;
+	lock_release(&buffer_cache_lock);
+}
 
-	block_read(fs_device, sector_idx, bc->data);
+/* Prints buffer cache statistics. */
+void
+buffer_cache_print_stats(void){
+	static const char* class_names[BC_CLASS_CNT] = {
+		"data", "inode", "indirect", "directory", "free-map"
+	};
+	struct buffer_cache_stats stats = buffer_cache_stats;
+	int i;
 
-#ifdef INFO5
-	printf("sector idx %d is written to buffer cache to idx %d, bc:%p\n", sector_idx, idx, bc);
-	if (sector_idx==0){
-		for (i=0; i<128; i++){
-			printf("%d ", ((int*)(bc->data))[i]);
-		}
-		printf("\nis after\n");
-		struct buffer_cache test;
-		block_read(fs_device, sector_idx, &test);
-		printf("test\n");
+	if (buffer_cache_arr == NULL)
+		return;
+
+	printf("Buffer cache: %d sectors, %llu hits, %llu misses, %llu evictions\n",
+				 buffer_cache_size, stats.hits, stats.misses, stats.evictions);
+	printf("Buffer cache: %llu periodic writes, %llu eviction writes, "
+				 "%llu sync writes, %llu lock waits for %llu ticks\n",
+				 stats.periodic_writes, stats.eviction_writes, stats.sync_writes,
+				 stats.lock_waits, stats.lock_wait_ticks);
+	for (i = 0; i < BC_CLASS_CNT; i++)
+		printf("Buffer cache: %s: %llu hits, %llu misses\n",
+					 class_names[i], stats.class_hits[i], stats.class_misses[i]);
+}
+
+static struct list*
+buffer_cache_bucket(block_sector_t sector_idx){
+	return buffer_cache_hash + (sector_idx & (buffer_cache_hash_size - 1));
+}
+
+/* Returns the slot for SECTOR_IDX, if any, without touching its
+   replacement state.  Must be called with buffer_cache_lock held. */
+static struct buffer_cache*
+lookup_buffer_cache(block_sector_t sector_idx){
+	struct list* bucket = buffer_cache_bucket(sector_idx);
+	struct list_elem* e;
+	struct buffer_cache* bc;
+
+	for (e = list_begin(bucket); e != list_end(bucket); e = list_next(e)) {
+		bc = list_entry(e, struct buffer_cache, hash_elem);
+		if (bc->sector_idx == sector_idx)
+			return bc;
 	}
 
+	return NULL;
+}
+
+static struct list*
+buffer_cache_ghost_bucket(block_sector_t sector_idx){
+	return buffer_cache_ghost_hash + (sector_idx & (buffer_cache_hash_size - 1));
+}
+
+/* Like lookup_buffer_cache(), but counts a reference to the
+   slot: a slot on Am moves to its front, while a slot on A1in
+   stays where it is, since 2Q treats references made shortly
+   after a sector came in as one.  Must be called with
+   buffer_cache_lock held. */
+struct buffer_cache*
+is_in_buffer_cache_arr(block_sector_t sector_idx){
+	struct buffer_cache* bc = lookup_buffer_cache(sector_idx);
 
+	if (bc != NULL) {
+		if (bc->queue == BC_QUEUE_AM) {
+			list_remove(&bc->queue_elem);
+			list_push_front(&buffer_cache_am, &bc->queue_elem);
+		}
+#ifdef INFO
+		printf("found sector_idx %d at buffer cache %p\n", sector_idx, bc);
 #endif
+	}
 
 	return bc;
 }
 
+/* Puts BC at the front of the queue named by bc->queue.  Must be
+   called with buffer_cache_lock held. */
+static void
+enqueue_buffer_cache(struct buffer_cache* bc){
+	if (bc->queue == BC_QUEUE_AM)
+		list_push_front(&buffer_cache_am, &bc->queue_elem);
+	else {
+		list_push_front(&buffer_cache_a1in, &bc->queue_elem);
+		buffer_cache_a1in_cnt++;
+	}
+}
+
+/* Adds SECTOR_IDX to the front of A1out, recycling the oldest
+   ghost when the list is full.  Must be called with
+   buffer_cache_lock held. */
+static void
+remember_buffer_cache_ghost(block_sector_t sector_idx){
+	struct buffer_cache_ghost* g;
 
-int
-find_empty_in_buffer_cache_arr() {
-	int i=0, empty_idx=-1;
-	struct buffer_cache* bc;
+	if (buffer_cache_ghost_size == 0)
+		return;
+
+	if (buffer_cache_ghost_cnt < buffer_cache_ghost_size)
+		g = buffer_cache_ghost_arr + buffer_cache_ghost_cnt++;
+	else {
+		g = list_entry(list_pop_back(&buffer_cache_a1out), struct buffer_cache_ghost, fifo_elem);
+		if (g->sector_idx != (block_sector_t) -1)
+			list_remove(&g->hash_elem);
+	}
+
+	g->sector_idx = sector_idx;
+	list_push_front(&buffer_cache_a1out, &g->fifo_elem);
+	list_push_front(buffer_cache_ghost_bucket(sector_idx), &g->hash_elem);
+}
 
-	for (i = 0; i < BUFFER_CACHE_ARR_SIZE; i++) {
-		bc = buffer_cache_arr + i;
-		if (bc->is_used==false) {
-			empty_idx = i;
-			return empty_idx;
+/* If SECTOR_IDX is on A1out, unhashes its ghost and moves it to
+   the back, where it is the next to be recycled, and returns
+   true.  Must be
+   called with buffer_cache_lock held. */
+static bool
+forget_buffer_cache_ghost(block_sector_t sector_idx){
+	struct list* bucket = buffer_cache_ghost_bucket(sector_idx);
+	struct list_elem* e;
+	struct buffer_cache_ghost* g;
+
+	for (e = list_begin(bucket); e != list_end(bucket); e = list_next(e)) {
+		g = list_entry(e, struct buffer_cache_ghost, hash_elem);
+		if (g->sector_idx == sector_idx) {
+			list_remove(&g->hash_elem);
+			list_remove(&g->fifo_elem);
+			list_push_back(&buffer_cache_a1out, &g->fifo_elem);
+			g->sector_idx = (block_sector_t) -1;
+			return true;
 		}
 	}
 
-	empty_idx = choose_victim_in_buffer_cache_arr();
-	if(empty_idx == -1)
-		PANIC("failed to find empty in buffer_cache_arr\n");
-	
-	return empty_idx;
+	return false;
 }
 
+/* Takes a slot off the free list, or returns a null pointer if
+   there is none.  Must be called with buffer_cache_lock held. */
+struct buffer_cache*
+find_empty_in_buffer_cache_arr() {
+	if (list_empty(&buffer_cache_free_list))
+		return NULL;
 
-int
-choose_victim_in_buffer_cache_arr() {
-	int i=0, victim_idx=-1;
-	int min_access_cnt=INT_MAX;
+	return list_entry(list_pop_front(&buffer_cache_free_list), struct buffer_cache, queue_elem);
+}
+
+/* Returns the least recently inserted or used slot of QUEUE that
+   is valid and unpinned, or a null pointer.  Slots of the running
+   journal transaction are only returned if TXN_OK. */
+static struct buffer_cache*
+choose_victim_in_queue(struct list* queue, bool txn_ok) {
+	struct list_elem* e;
 	struct buffer_cache* bc;
 
-	for (i = 0; i < BUFFER_CACHE_ARR_SIZE; i++) {
-		bc = buffer_cache_arr + i;
-		if (bc->is_used==true && bc->is_accessed==false) {
-			victim_idx = i;
-			break;
-		}
+	for (e = list_rbegin(queue); e != list_rend(queue); e = list_prev(e)) {
+		bc = list_entry(e, struct buffer_cache, queue_elem);
+		if (bc->state == BC_VALID && bc->pin_cnt == 0 && !is_virtual_sector(bc->sector_idx)
+				&& (txn_ok || !bc->in_txn))
+			return bc;
+	}
 
-		if (min_access_cnt > bc->access_cnt){
-			min_access_cnt = bc->access_cnt;
-			victim_idx = i;
-		}
-	}	
+	return NULL;
+}
 
-	bc = buffer_cache_arr + victim_idx;
+/* Picks a victim from A1in or Am, as described below. */
+static struct buffer_cache*
+choose_victim_in_queues(bool txn_ok) {
+	struct buffer_cache* bc = NULL;
+	bool a1in_first = buffer_cache_a1in_cnt * 100 > buffer_cache_size * BUFFER_CACHE_A1IN_RATIO;
+
+	if (a1in_first)
+		bc = choose_victim_in_queue(&buffer_cache_a1in, txn_ok);
+	if (bc == NULL)
+		bc = choose_victim_in_queue(&buffer_cache_am, txn_ok);
+	if (bc == NULL && !a1in_first)
+		bc = choose_victim_in_queue(&buffer_cache_a1in, txn_ok);
+	return bc;
+}
 
-#ifdef INFO5
-	printf("victim idx is %d and its sector %d\n", victim_idx, bc->sector_idx);
-	if (bc->sector_idx==0){
-		int i=0;
-		for (i=0; i<128; i++){
-			printf("%d ", ((int*)(bc->data))[i]);
-		}
+/* Chooses a valid, unpinned slot to replace, takes it off its
+   queue and returns it, or returns a null pointer if every slot
+   is pinned, virtual or has I/O in flight.  A1in gives up its
+   oldest slot while it is over its share of the cache, and its
+   number is remembered on A1out; otherwise the least recently used
+   slot of Am goes.  Uncommitted metadata is only chosen when there
+   is nothing else, since writing it home early gives up the
+   atomicity of its transaction.  Writing back a dirty victim is
+   left to the caller.  Must be called with buffer_cache_lock held. */
+struct buffer_cache*
+choose_victim_in_buffer_cache_arr() {
+	struct buffer_cache* bc = choose_victim_in_queues(false);
+
+	if (bc == NULL)
+		bc = choose_victim_in_queues(true);
+	if (bc == NULL)
+		return NULL;
+
+	list_remove(&bc->queue_elem);
+	if (bc->queue == BC_QUEUE_A1IN) {
+		buffer_cache_a1in_cnt--;
+		remember_buffer_cache_ghost(bc->sector_idx);
 	}
-	printf("\nwritten to addr %p if dirty %d\n", bc->data, bc->is_dirty);
+	bc->queue = BC_QUEUE_NONE;
+
+#ifdef INFO5
+	printf("victim is %p and its sector %d, dirty %d\n", bc, bc->sector_idx, bc->is_dirty);
 #endif
 
-	if(victim_idx == -1)
-		PANIC("failed to find victim in buffer_cache_arr\n");
+	return bc;
+}
+
+
+/* Queues SECTOR_IDX to be read into the cache in the background. */
+void
+request_read_ahead_buffer_cache(block_sector_t sector_idx) {
+	lock_acquire(&read_ahead_lock);
 
-	if (bc->is_dirty==true)
-		block_write(fs_device, bc->sector_idx, bc->data);
+	if (read_ahead_cnt < READ_AHEAD_QUEUE_SIZE) {
+		read_ahead_queue[(read_ahead_head + read_ahead_cnt) % READ_AHEAD_QUEUE_SIZE] = sector_idx;
+		read_ahead_cnt++;
+		cond_signal(&read_ahead_ready, &read_ahead_lock);
+	}
 
-	return victim_idx;
+	lock_release(&read_ahead_lock);
 }
 
 void
-clock_algorithm_for_buffer_cache_arr(int tick) {
-	if (buffer_cache_arr == NULL)
-		return;
+run_read_ahead_buffer_cache() {
+	thread_create("buffer_cache_read_ahead", PRI_DEFAULT, read_ahead_buffer_cache_in_background, NULL);
+}
 
-	int idx = tick % BUFFER_CACHE_ARR_SIZE;
-	struct buffer_cache* bc;
-	bc = buffer_cache_arr+ idx;
+void
+read_ahead_buffer_cache_in_background(void* aux UNUSED) {
+	block_sector_t sector_idx;
 
-	if (bc->is_used==true && bc->is_accessed==true) 
-		bc->is_accessed = false;
+	while(true) {
+		lock_acquire(&read_ahead_lock);
+		while (read_ahead_cnt == 0)
+			cond_wait(&read_ahead_ready, &read_ahead_lock);
+		sector_idx = read_ahead_queue[read_ahead_head];
+		read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+		read_ahead_cnt--;
+		lock_release(&read_ahead_lock);
+
+		prefetch_buffer_cache_from_sector(sector_idx);
+	}
 }
 
 
@@ -234,18 +887,48 @@ run_dirty_buffer_cache_writer() {
 	thread_create("dirty_buffer_cache_writer", PRI_DEFAULT, write_dirty_buffer_cache_to_sector_periodically, NULL);
 }
 
+/* Wakes the dirty writer.  Called from the timer interrupt once
+   every TIMER_FREQ ticks and from set_buffer_cache_dirty(), so
+   it must not sleep.  The timer starts before buffer_cache_init()
+   runs, and until then there is nothing to wake. */
+void
+wake_dirty_buffer_cache_writer() {
+	if (buffer_cache_arr == NULL || buffer_cache_writer_woken)
+		return;
+
+	buffer_cache_writer_woken = true;
+	sema_up(&buffer_cache_writer_sema);
+}
+
 
 void
 write_dirty_buffer_cache_to_sector_periodically(void* aux UNUSED) {
 	while(true) {
+		sema_down(&buffer_cache_writer_sema);
+		buffer_cache_writer_woken = false;
 		write_dirty_buffer_cache_to_sector();
-		timer_sleep(TIMER_FREQ);
 	}
 
 	return;
 }
 
 
+static int
+compare_buffer_cache_sector(const void* a_, const void* b_) {
+	const struct buffer_cache* a = *(struct buffer_cache* const*) a_;
+	const struct buffer_cache* b = *(struct buffer_cache* const*) b_;
+
+	return a->sector_idx < b->sector_idx ? -1 : a->sector_idx > b->sector_idx;
+}
+
+
+/* Writes every slot on the dirty list back to disk in ascending
+   sector order and clears its dirty state, then commits the running
+   journal transaction.  Writing the data before the metadata that
+   points to it is what keeps a crash from leaving a file with
+   sectors it never wrote.  This is also the sync system call, and
+   returns only once every write it or an overlapping pass started
+   has reached the disk. */
 void
 write_dirty_buffer_cache_to_sector(void) {
 	if (buffer_cache_arr == NULL)
@@ -255,24 +938,33 @@ write_dirty_buffer_cache_to_sector(void) {
 	printf("interrupt\n");
 #endif
 
-	int i=0;
-	struct buffer_cache* bc=NULL;
+	struct buffer_cache** slots = malloc(sizeof *slots * buffer_cache_size);
+	char* bounce = malloc(BLOCK_SECTOR_SIZE);
+	int cnt;
 
-	lock_acquire(&buffer_cache_lock);
+	if (slots == NULL || bounce == NULL) {
+		free(slots);
+		free(bounce);
+		return;
+	}
 
-	for (i = 0; i < BUFFER_CACHE_ARR_SIZE; i++) {
-		bc = buffer_cache_arr + i;
-		if (bc->is_used==true && bc->is_dirty==true) {
-#ifdef INFO5
-			if (bc->sector_idx==0)
-				printf("sector 0 is written peridicallly\n");
-#endif
+	lock_acquire(&buffer_cache_flush_lock);
 
-			block_write(fs_device, bc->sector_idx, bc->data);
-		}
-	}
+	/* Give data written into holes its sectors first, then bring the
+		 free map file up to date, so that the metadata both change is
+		 committed along with the rest. */
+	inode_flush_delayed();
+	free_map_flush();
 
-	lock_release(&buffer_cache_lock);
+	cnt = collect_dirty_buffer_cache(slots, BC_COLLECT_ALL, 0);
+	write_back_buffer_cache(slots, cnt, bounce, &buffer_cache_stats.periodic_writes);
+	free(slots);
+	free(bounce);
+	wait_for_buffer_cache_writes();
+
+	journal_commit();
+
+	lock_release(&buffer_cache_flush_lock);
 
 #ifdef INFO5
 	printf("interrupt finished\n");
@@ -281,5 +973,146 @@ write_dirty_buffer_cache_to_sector(void) {
 	return;
 }
 
+/* Writes the dirty slots of sectors allocated since the last commit
+   back to disk and waits for them to get there.  journal_commit()
+   calls this once the handles have drained: those are the only data
+   sectors the metadata about to be committed can point to without
+   their contents being on disk already, whether the writer's pass
+   missed them or fsync() committed without one. */
+void
+write_fresh_buffer_cache_to_sector(void) {
+	struct buffer_cache** slots;
+	char* bounce;
+	int cnt;
+
+	if (buffer_cache_arr == NULL)
+		return;
+
+	slots = malloc(sizeof *slots * buffer_cache_size);
+	bounce = malloc(BLOCK_SECTOR_SIZE);
+	if (slots != NULL && bounce != NULL) {
+		cnt = collect_dirty_buffer_cache(slots, BC_COLLECT_FRESH, 0);
+		write_back_buffer_cache(slots, cnt, bounce, &buffer_cache_stats.periodic_writes);
+	}
+	free(slots);
+	free(bounce);
+
+	wait_for_buffer_cache_writes();
+}
+
+/* Writes the dirty data slots of the file whose inode is at OWNER
+   back to disk, and nothing else, and waits for them to get there.
+   Its metadata is left to the journal; see inode_sync(). */
+void
+write_owned_buffer_cache_to_sector(block_sector_t owner) {
+	struct buffer_cache** slots;
+	char* bounce;
+	int cnt;
+
+	if (buffer_cache_arr == NULL)
+		return;
+
+	lock_acquire(&buffer_cache_flush_lock);
+	slots = malloc(sizeof *slots * buffer_cache_size);
+	bounce = malloc(BLOCK_SECTOR_SIZE);
+	if (slots != NULL && bounce != NULL) {
+		cnt = collect_dirty_buffer_cache(slots, BC_COLLECT_OWNED, owner);
+		write_back_buffer_cache(slots, cnt, bounce, &buffer_cache_stats.sync_writes);
+	}
+	free(slots);
+	free(bounce);
+
+	wait_for_buffer_cache_writes();
+	lock_release(&buffer_cache_flush_lock);
+}
+
+/* Pins the dirty slots that are neither virtual nor part of the
+   journal transaction and that WHICH asks for, stores them into
+   SLOTS, which must have room for every slot, in ascending sector
+   order and returns how many there were.  OWNER is the inode for
+   BC_COLLECT_OWNED. */
+static int
+collect_dirty_buffer_cache(struct buffer_cache** slots, enum buffer_cache_collect which, block_sector_t owner) {
+	struct list_elem* e;
+	struct buffer_cache* bc;
+	int cnt = 0;
+
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	for (e = list_begin(&buffer_cache_dirty_list); e != list_end(&buffer_cache_dirty_list);
+			 e = list_next(e)) {
+		bc = list_entry(e, struct buffer_cache, dirty_elem);
+		if (is_virtual_sector(bc->sector_idx) || bc->in_txn)
+			continue;
+		if ((which == BC_COLLECT_OWNED && bc->owner != owner)
+				|| (which == BC_COLLECT_FRESH && !bc->fresh))
+			continue;
+		bc->pin_cnt++;
+		slots[cnt++] = bc;
+	}
+	lock_release(&buffer_cache_lock);
+
+	qsort(slots, cnt, sizeof *slots, compare_buffer_cache_sector);
+	return cnt;
+}
+
+/* Writes the CNT slots in SLOTS, pinned by
+   collect_dirty_buffer_cache(), that are still dirty back to disk,
+   counting them in *WRITES, and unpins them.
+
+   Each slot is copied to the sector-sized BOUNCE buffer under its
+   own lock, so neither that lock nor buffer_cache_lock is held
+   while the disk is busy and readers of the slot are never held
+   up.  A slot that is dirtied again while its old contents are on
+   the way to disk simply goes back on the list, and one that has
+   joined the journal transaction meanwhile is left to the commit.
+   The slot is marked writing until the write completes, which is
+   what wait_for_buffer_cache_writes() looks for; a pass that finds
+   a slot still being written by another waits for that write
+   first, so the newer contents always land last. */
+static void
+write_back_buffer_cache(struct buffer_cache** slots, int cnt, char* bounce, unsigned long long* writes) {
+	struct buffer_cache* bc;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		bc = slots[i];
+
+		acquire_buffer_cache_lock(&bc->lock);
+		acquire_buffer_cache_lock(&buffer_cache_lock);
+		while (bc->writing)
+			cond_wait(&buffer_cache_changed, &buffer_cache_lock);
+		bool is_dirty = bc->is_dirty && !bc->in_txn;
+		if (is_dirty) {
+			(*writes)++;
+			clean_buffer_cache(bc);
+			bc->writing = true;
+		}
+		lock_release(&buffer_cache_lock);
+		if (is_dirty)
+			memcpy(bounce, bc->data, BLOCK_SECTOR_SIZE);
+		lock_release(&bc->lock);
+
+		if (is_dirty)
+			block_write(fs_device, bc->sector_idx, bounce);
+
+		acquire_buffer_cache_lock(&buffer_cache_lock);
+		bc->writing = false;
+		ASSERT(bc->pin_cnt > 0);
+		bc->pin_cnt--;
+		cond_broadcast(&buffer_cache_changed, &buffer_cache_lock);
+		lock_release(&buffer_cache_lock);
+	}
+}
 
+/* Waits until no slot is being written back, so that everything a
+   pass cleaned, even one that overlapped it, is on disk. */
+static void
+wait_for_buffer_cache_writes(void) {
+	int i;
 
+	acquire_buffer_cache_lock(&buffer_cache_lock);
+	for (i = 0; i < buffer_cache_size; i++)
+		while (buffer_cache_arr[i].writing)
+			cond_wait(&buffer_cache_changed, &buffer_cache_lock);
+	lock_release(&buffer_cache_lock);
+}
@@ -1,27 +1,141 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <list.h>
 #include <devices/block.h>
+#include "threads/synch.h"
 
+/* Default number of slots; -cache=N on the kernel command line
+   overrides it. */
 #define BUFFER_CACHE_ARR_SIZE 64
+#define BUFFER_CACHE_MIN_SIZE 16
+
+/* Replacement is 2Q: a sector enters on the A1in FIFO, which
+   may hold this percentage of the slots, and is only promoted to
+   the Am LRU list if it is missed again while its number is
+   still remembered on the A1out ghost list, which holds this
+   percentage of the slot count in sector numbers.  A single long
+   sequential read thus cycles through A1in and leaves the
+   repeatedly used metadata in Am alone. */
+#define BUFFER_CACHE_A1IN_RATIO 25
+#define BUFFER_CACHE_A1OUT_RATIO 50
+
+/* Read-ahead never keeps more than this many sectors in flight
+   for one reader, so that it cannot push the whole cache out. */
+#define BUFFER_CACHE_READ_AHEAD_MAX (get_buffer_cache_size () / 4)
+#define READ_AHEAD_QUEUE_SIZE 64
+
+/* The dirty writer is woken early once this percentage of the
+   cache is dirty, instead of waiting for its next period. */
+#define BUFFER_CACHE_DIRTY_RATIO 50
+
+/* Sector numbers from here up do not exist on disk.  They name
+   cache slots holding file data that has been written before a
+   sector was allocated for it (see inode.c).  Such slots are never
+   read in, written back or evicted; they are renamed to a real
+   sector with rename_buffer_cache() once one is allocated.  They
+   stay below INT_MAX, since inode.c passes sectors around as int. */
+#define BUFFER_CACHE_VIRTUAL_SECTOR 0x40000000u
+#define BUFFER_CACHE_VIRTUAL_END 0x7fffffffu
+
+static inline bool
+is_virtual_sector (block_sector_t sector_idx)
+{
+  return sector_idx >= BUFFER_CACHE_VIRTUAL_SECTOR
+         && sector_idx < BUFFER_CACHE_VIRTUAL_END;
+}
+
+/* What a cached sector holds, as far as the caller that last
+   pinned it knows.  Everything but BC_CLASS_DATA is metadata, which
+   is journaled (see journal.c). */
+enum buffer_cache_class {
+	BC_CLASS_DATA,                      /* Regular file data. */
+	BC_CLASS_INODE,                     /* On-disk inode. */
+	BC_CLASS_INDIRECT,                  /* Block of sector pointers. */
+	BC_CLASS_DIR,                       /* Directory entries. */
+	BC_CLASS_FREE_MAP,                  /* Free map file contents. */
+	BC_CLASS_CNT
+};
+
+/* Buffer cache counters, reported at shutdown and by the
+   cachestat system call. */
+struct buffer_cache_stats {
+	unsigned long long hits;            /* Lookups that found the sector. */
+	unsigned long long misses;          /* Lookups that had to read it. */
+	unsigned long long evictions;       /* Valid slots replaced. */
+	unsigned long long periodic_writes; /* Sectors written by the flusher. */
+	unsigned long long eviction_writes; /* Dirty victims written back. */
+	unsigned long long sync_writes;     /* Written by fsync and fdatasync. */
+	unsigned long long lock_waits;      /* Contended cache lock acquires. */
+	unsigned long long lock_wait_ticks; /* Timer ticks spent waiting. */
+	unsigned long long class_hits[BC_CLASS_CNT];
+	unsigned long long class_misses[BC_CLASS_CNT];
+	unsigned long long dirty;           /* Dirty slots when copied. */
+};
+
+/* 2Q queue a slot is on. */
+enum buffer_cache_queue {
+	BC_QUEUE_NONE,                      /* Empty or being replaced. */
+	BC_QUEUE_A1IN,                      /* First-time FIFO. */
+	BC_QUEUE_AM                         /* Frequently used LRU. */
+};
+
+/* Life cycle of a buffer cache slot.  Slots in BC_LOADING or
+   BC_EVICTING have disk I/O in flight and are only touched by the
+   thread doing that I/O; everybody else waits for the state to
+   change. */
+enum buffer_cache_state {
+	BC_EMPTY,                           /* Holds no sector. */
+	BC_LOADING,                         /* Being read from disk. */
+	BC_VALID,                           /* Holds a valid copy of sector_idx. */
+	BC_EVICTING                         /* Being written back before reuse. */
+};
 
 struct buffer_cache {
   char data[BLOCK_SECTOR_SIZE];
   block_sector_t sector_idx;
-  bool is_used;
-  bool is_accessed;
+	enum buffer_cache_state state;
   bool is_dirty;
-	int access_cnt;
+	enum buffer_cache_queue queue;
+	int pin_cnt;                        /* Pinned slots are never evicted. */
+	enum buffer_cache_class class;      /* What the sector holds. */
+	bool in_txn;                        /* Dirty metadata not yet committed. */
+	bool fresh;                         /* Sector allocated since last commit. */
+	bool writing;                       /* Being written back. */
+	block_sector_t owner;               /* Inode whose data this is, if any. */
+	struct lock lock;                   /* Serializes access to data. */
+	struct list_elem hash_elem;         /* Element in sector hash bucket. */
+	struct list_elem dirty_elem;        /* Element in dirty list if is_dirty. */
+	struct list_elem queue_elem;        /* Element in free list, A1in or Am. */
 };
 
+void buffer_cache_configure(int);
+int get_buffer_cache_size(void);
 void buffer_cache_init(void);
-struct buffer_cache* get_buffer_cache_value_from_sector(block_sector_t);
-void write_src_to_buffer_cache_from_sector(block_sector_t, int, const void*, int);
-struct buffer_cache* get_buffer_cache_from_sector(block_sector_t);
+struct buffer_cache* pin_buffer_cache_from_sector(block_sector_t, enum buffer_cache_class);
+struct buffer_cache* pin_new_buffer_cache_from_sector(block_sector_t, enum buffer_cache_class);
+void unpin_buffer_cache(struct buffer_cache*);
+void set_buffer_cache_dirty(struct buffer_cache*);
+void write_src_to_buffer_cache_from_sector(block_sector_t, int, const void*, int, enum buffer_cache_class);
+void write_src_to_owned_buffer_cache_from_sector(block_sector_t, int, const void*, int, enum buffer_cache_class, block_sector_t);
+void read_buffer_cache_to_dst_from_sector(block_sector_t, int, void*, int, enum buffer_cache_class);
+block_sector_t new_virtual_buffer_cache_sector(void);
+void rename_buffer_cache(block_sector_t, block_sector_t);
+void discard_buffer_cache(block_sector_t);
+int collect_journal_buffer_cache(struct buffer_cache**, int);
+void release_journal_buffer_cache(struct buffer_cache**, int);
+int count_journal_buffer_cache(void);
+void get_buffer_cache_stats(struct buffer_cache_stats*);
+void buffer_cache_print_stats(void);
 struct buffer_cache* is_in_buffer_cache_arr(block_sector_t);
-struct buffer_cache* write_in_buffer_cache_arr(block_sector_t);
-int find_empty_in_buffer_cache_arr(void);
-int choose_victim_in_buffer_cache_arr(void);
-void clock_algorithm_for_buffer_cache_arr(int);
+struct buffer_cache* find_empty_in_buffer_cache_arr(void);
+struct buffer_cache* choose_victim_in_buffer_cache_arr(void);
+void prefetch_buffer_cache_from_sector(block_sector_t);
+void request_read_ahead_buffer_cache(block_sector_t);
+void run_read_ahead_buffer_cache(void);
+void read_ahead_buffer_cache_in_background(void*);
 void run_dirty_buffer_cache_writer(void);
+void wake_dirty_buffer_cache_writer(void);
 void write_dirty_buffer_cache_to_sector_periodically(void*);
 void write_dirty_buffer_cache_to_sector(void);
+void write_owned_buffer_cache_to_sector(block_sector_t);
+void write_fresh_buffer_cache_to_sector(void);
@@ -1,10 +1,14 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 
 char DIR_DELIMIT = '/';
@@ -21,25 +25,299 @@ struct dir
 /* A single directory entry. */
 struct dir_entry 
   {
-    block_sector_t inode_sector;        /* Sector number of header. */
+    block_sector_t inode_sector;        /* Sector number of header, or
+                                           next free entry if free. */
     char name[NAME_MAX + 1];            /* Null terminated file name. */
     bool in_use;                        /* In use or free? */
 		bool is_dir;
   };
 
-/* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+/* Identifies a directory header. */
+#define DIR_MAGIC 0x44495248
+
+/* The first entry-sized slot of a directory file holds this header;
+   the entries proper start at DIR_ENTRIES_OFS.  Names are found
+   through a hash index kept in a file of its own, an open
+   addressing table of INDEX_CAP records, each giving the hash of a
+   name and the offset of its entry.  Entries never move, so
+   dir_readdir() sees them in the order they were added; freed ones
+   are chained from FREE_OFS through their inode_sector fields and
+   reused first. */
+struct dir_header
+  {
+    unsigned magic;                     /* DIR_MAGIC. */
+    block_sector_t index_sector;        /* Inode of the hash index. */
+    uint32_t index_cap;                 /* Index records, a power of 2. */
+    uint32_t index_cnt;                 /* Index records in use. */
+    off_t free_ofs;                     /* First free entry, or 0. */
+  };
+
+#define DIR_ENTRIES_OFS ((off_t) sizeof (struct dir_entry))
+
+/* A record in the hash index. */
+struct dir_index_rec
+  {
+    uint32_t hash;                      /* dir_hash() of the name. */
+    off_t ofs;                          /* Offset of the entry, 0 if empty. */
+  };
+
+/* Smallest index, one sector's worth of records.  The index
+   doubles whenever it gets more than 3/4 full. */
+#define DIR_INDEX_MIN_CAP (BLOCK_SECTOR_SIZE / sizeof (struct dir_index_rec))
+
+static bool lookup (const struct dir *, const char *, struct dir_entry *, off_t *);
+static bool read_header (const struct dir *, struct dir_header *);
+static bool write_header (struct dir *, const struct dir_header *);
+static bool create_index (block_sector_t near, uint32_t cap, block_sector_t *);
+static bool grow_index (struct dir *, struct dir_header *);
+static bool index_insert (struct inode *, uint32_t cap, uint32_t hash, off_t ofs);
+static void index_delete (struct dir_header *, uint32_t hash, off_t ofs);
+
+/* Name cache.  Remembers what looking up a name in a directory
+   found, the inode sector and whether it is a directory, or that
+   there was nothing (a negative entry, with sector 0), so that
+   resolving a path that was resolved recently does not read any
+   directory.  Entries are replaced in LRU order beyond
+   DCACHE_MAX. */
+#define DCACHE_MAX 256
+
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dcache. */
+    struct list_elem lru_elem;          /* Element in dcache_lru. */
+    block_sector_t parent;              /* Directory looked in. */
+    block_sector_t sector;              /* What was found, 0 if nothing. */
+    bool is_dir;                        /* Found a directory? */
+    char name[NAME_MAX + 1];            /* Name looked up. */
+  };
+
+static struct hash dcache;
+static struct list dcache_lru;          /* Most recently used first. */
+static struct lock dcache_lock;
+
+/* Bumped whenever a directory changes, so that a lookup that raced
+   with the change does not cache its stale result. */
+static unsigned dcache_generation;
+
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Initializes the directory module. */
+void
+dir_init (void)
+{
+  hash_init (&dcache, dentry_hash, dentry_less, NULL);
+  list_init (&dcache_lru);
+  lock_init (&dcache_lock);
+}
+
+/* Returns the cached entry for NAME in the directory at PARENT, or
+   a null pointer.  Must be called with dcache_lock held. */
+static struct dentry *
+dcache_find (block_sector_t parent, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Drops D from the cache.  Must be called with dcache_lock held. */
+static void
+dcache_drop (struct dentry *d)
+{
+  hash_delete (&dcache, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  free (d);
+}
+
+/* Looks NAME in the directory at PARENT up in the cache.  If it is
+   there, stores what was found in *SECTOR, 0 if nothing, and
+   *IS_DIR and returns true. */
+static bool
+dcache_get (block_sector_t parent, const char *name,
+            block_sector_t *sector, bool *is_dir)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = dcache_find (parent, name);
+  if (d != NULL)
+    {
+      *sector = d->sector;
+      *is_dir = d->is_dir;
+      list_remove (&d->lru_elem);
+      list_push_front (&dcache_lru, &d->lru_elem);
+    }
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Caches what looking NAME up in the directory at PARENT found,
+   unless a directory changed since GENERATION was read. */
+static void
+dcache_put (block_sector_t parent, const char *name, block_sector_t sector,
+            bool is_dir, unsigned generation)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  if (generation == dcache_generation && dcache_find (parent, name) == NULL
+      && (d = malloc (sizeof *d)) != NULL)
+    {
+      d->parent = parent;
+      d->sector = sector;
+      d->is_dir = is_dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dcache, &d->hash_elem);
+      list_push_front (&dcache_lru, &d->lru_elem);
+      if (hash_size (&dcache) > DCACHE_MAX)
+        dcache_drop (list_entry (list_back (&dcache_lru), struct dentry, lru_elem));
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Returns the current cache generation, for dcache_put(). */
+static unsigned
+dcache_begin (void)
+{
+  unsigned generation;
+
+  lock_acquire (&dcache_lock);
+  generation = dcache_generation;
+  lock_release (&dcache_lock);
+  return generation;
+}
+
+/* Forgets NAME in the directory at PARENT, where it has just been
+   added or removed.  If NAME was a directory being removed, pass
+   its sector as REMOVED_DIR to forget the names in it as well,
+   since the sector may be reused; otherwise pass 0. */
+static void
+dcache_invalidate (block_sector_t parent, const char *name,
+                   block_sector_t removed_dir)
+{
+  struct list_elem *e, *next;
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  dcache_generation++;
+  d = dcache_find (parent, name);
+  if (d != NULL)
+    dcache_drop (d);
+  if (removed_dir != 0)
+    for (e = list_begin (&dcache_lru); e != list_end (&dcache_lru); e = next)
+      {
+        next = list_next (e);
+        d = list_entry (e, struct dentry, lru_elem);
+        if (d->parent == removed_dir)
+          dcache_drop (d);
+      }
+  lock_release (&dcache_lock);
+}
+
+/* Looks NAME up in DIR through the name cache.  Stores the sector
+   of its inode, 0 if there is none, in *SECTOR and whether it is a
+   directory in *IS_DIR.  A name longer than NAME_MAX cannot be in
+   any directory and is never cached, since the cache keeps only
+   the first NAME_MAX characters of a name.
+   A miss reads DIR under its directory lock.  Closing the index
+   may end a journal handle's worth of work, and handles are always
+   begun before a directory lock is taken, so one is begun here
+   too. */
+static void
+cached_lookup (const struct dir *dir, const char *name,
+               block_sector_t *sector, bool *is_dir)
+{
+  block_sector_t parent = inode_get_inumber (dir->inode);
+  struct dir_entry e;
+  unsigned generation;
+
+  *sector = 0;
+  *is_dir = false;
+  if (strnlen (name, NAME_MAX + 1) > NAME_MAX)
+    return;
+
+  if (dcache_get (parent, name, sector, is_dir))
+    return;
+
+  journal_begin ();
+  inode_lock_dir (dir->inode);
+  generation = dcache_begin ();
+  if (lookup (dir, name, &e, NULL))
+    {
+      *sector = e.inode_sector;
+      *is_dir = e.is_dir;
+    }
+  dcache_put (parent, name, *sector, *is_dir, generation);
+  inode_unlock_dir (dir->inode);
+  journal_end ();
+}
+
+/* Returns the FNV-1a hash of NAME. */
+static uint32_t
+dir_hash (const char *name)
+{
+  uint32_t hash = 2166136261u;
+
+  for (; *name != '\0'; name++)
+    hash = (hash ^ (uint8_t) *name) * 16777619u;
+  return hash;
+}
+
+/* Creates a directory in the given SECTOR, with an index sized for
+   ENTRY_CNT entries.  Returns true if successful, false on
+   failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt, block_sector_t parent)
 {
-	bool success = inode_create (sector, entry_cnt * sizeof (struct dir_entry));
-	if (!success)
+	struct dir_header h;
+	uint32_t cap = DIR_INDEX_MIN_CAP;
+
+	while (cap * 3 < entry_cnt * 4)
+		cap *= 2;
+
+	memset(&h, 0, sizeof h);
+	h.magic = DIR_MAGIC;
+	h.index_cap = cap;
+	if (!create_index(sector, cap, &h.index_sector))
+		return false;
+
+	bool success = inode_create (sector, DIR_ENTRIES_OFS);
+	if (!success){
+		struct inode* index = inode_open(h.index_sector);
+		if (index != NULL) {
+			inode_remove(index);
+			inode_close(index);
+		}
 		return false;
+	}
 
 	struct dir* dir = dir_open(inode_open(sector));
 	if (dir == NULL){
 		PANIC("failed to inode_open at dir_create()");
 	}
+	if (!write_header(dir, &h))
+		PANIC("failed to write header at dir_create()");
 
 	success = dir_add (dir, "..", parent, true);
 	if (success==false){
@@ -50,6 +328,7 @@ dir_create (block_sector_t sector, size_t entry_cnt, block_sector_t parent)
 	if (success==false){
 		PANIC("failed to . at dir_add");
 	}
+	dir_close(dir);
 
 	return true;
 }
@@ -69,7 +348,8 @@ dir_open (struct inode *inode)
   if (inode != NULL && dir != NULL)
     {
       dir->inode = inode;
-      dir->pos = 0;
+      dir->pos = DIR_ENTRIES_OFS;
+      inode_mark_dir (inode);
       return dir;
     }
   else
@@ -114,6 +394,148 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Reads the header of DIR into *H.  Returns false if DIR has no
+   valid header. */
+static bool
+read_header (const struct dir *dir, struct dir_header *h)
+{
+  return inode_read_at (dir->inode, h, sizeof *h, 0) == sizeof *h
+         && h->magic == DIR_MAGIC;
+}
+
+/* Writes H as the header of DIR. */
+static bool
+write_header (struct dir *dir, const struct dir_header *h)
+{
+  return inode_write_at (dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Creates an empty index of CAP records near sector NEAR and
+   stores its inode sector in *SECTORP. */
+static bool
+create_index (block_sector_t near, uint32_t cap, block_sector_t *sectorp)
+{
+  if (free_map_allocate_run (near, 1, sectorp, false) != 1)
+    return false;
+  if (!inode_create (*sectorp, cap * sizeof (struct dir_index_rec)))
+    {
+      free_map_release (*sectorp, 1);
+      return false;
+    }
+  return true;
+}
+
+/* Adds a record for HASH and OFS to INDEX, which has CAP records
+   and at least one of them empty. */
+static bool
+index_insert (struct inode *index, uint32_t cap, uint32_t hash, off_t ofs)
+{
+  struct dir_index_rec rec;
+  uint32_t i, mask = cap - 1;
+
+  for (i = hash & mask; ; i = (i + 1) & mask)
+    {
+      if (inode_read_at (index, &rec, sizeof rec, i * sizeof rec) != sizeof rec)
+        return false;
+      if (rec.ofs == 0)
+        break;
+    }
+  rec.hash = hash;
+  rec.ofs = ofs;
+  return inode_write_at (index, &rec, sizeof rec, i * sizeof rec) == sizeof rec;
+}
+
+/* Replaces the index of DIR, whose header is *H, with one twice
+   the size holding the same records, and updates *H, which the
+   caller writes back.  The entries themselves do not move. */
+static bool
+grow_index (struct dir *dir, struct dir_header *h)
+{
+  struct dir_index_rec *recs;
+  struct inode *old_index, *new_index;
+  block_sector_t new_sector;
+  uint32_t cap = h->index_cap * 2, i, k;
+  const uint32_t per_sector = BLOCK_SECTOR_SIZE / sizeof *recs;
+  bool success = true;
+
+  recs = malloc (BLOCK_SECTOR_SIZE);
+  if (recs == NULL)
+    return false;
+  if (!create_index (inode_get_inumber (dir->inode), cap, &new_sector))
+    {
+      free (recs);
+      return false;
+    }
+
+  old_index = inode_open (h->index_sector);
+  new_index = inode_open (new_sector);
+  for (i = 0; success && i < h->index_cap; i += per_sector)
+    {
+      success = inode_read_at (old_index, recs, BLOCK_SECTOR_SIZE,
+                               i * sizeof *recs) == BLOCK_SECTOR_SIZE;
+      for (k = 0; success && k < per_sector; k++)
+        if (recs[k].ofs != 0)
+          success = index_insert (new_index, cap, recs[k].hash, recs[k].ofs);
+    }
+
+  inode_remove (success ? old_index : new_index);
+  inode_close (old_index);
+  inode_close (new_index);
+  free (recs);
+  if (success)
+    {
+      h->index_sector = new_sector;
+      h->index_cap = cap;
+      inode_set_companion (dir->inode, new_sector);
+    }
+  return success;
+}
+
+/* Deletes the record for HASH and OFS from the index described by
+   directory header *H, and updates *H, which the caller writes
+   back.
+   Records after it in the same probe sequence are moved up, so
+   that no tombstones are needed. */
+static void
+index_delete (struct dir_header *h, uint32_t hash, off_t ofs)
+{
+  struct inode *index = inode_open (h->index_sector);
+  struct dir_index_rec rec;
+  uint32_t mask = h->index_cap - 1, hole, i, home, n;
+
+  for (hole = hash & mask, n = 0; n < h->index_cap; hole = (hole + 1) & mask, n++)
+    {
+      if (inode_read_at (index, &rec, sizeof rec, hole * sizeof rec) != sizeof rec
+          || rec.ofs == 0)
+        {
+          inode_close (index);
+          return;
+        }
+      if (rec.ofs == ofs)
+        break;
+    }
+
+  for (i = (hole + 1) & mask; ; i = (i + 1) & mask)
+    {
+      if (inode_read_at (index, &rec, sizeof rec, i * sizeof rec) != sizeof rec
+          || rec.ofs == 0)
+        break;
+      /* REC can fill the hole unless its home lies cyclically
+         after the hole and no later than I. */
+      home = rec.hash & mask;
+      if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+          inode_write_at (index, &rec, sizeof rec, hole * sizeof rec);
+          hole = i;
+        }
+    }
+
+  memset (&rec, 0, sizeof rec);
+  inode_write_at (index, &rec, sizeof rec, hole * sizeof rec);
+  h->index_cnt--;
+  inode_close (index);
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -123,28 +545,45 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
+  struct dir_header h;
+  struct dir_index_rec rec;
   struct dir_entry e;
-  size_t ofs;
+  struct inode *index;
+  uint32_t hash, mask, i, n;
+  bool found = false;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e){ 
+  if (!read_header (dir, &h) || (index = inode_open (h.index_sector)) == NULL)
+    return false;
+
+  hash = dir_hash (name);
+  mask = h.index_cap - 1;
+  for (i = hash & mask, n = 0; n < h.index_cap; i = (i + 1) & mask, n++)
+    {
+      if (inode_read_at (index, &rec, sizeof rec, i * sizeof rec) != sizeof rec
+          || rec.ofs == 0)
+        break;
+      if (rec.hash != hash
+          || inode_read_at (dir->inode, &e, sizeof e, rec.ofs) != sizeof e)
+        continue;
 #ifdef INFO16
 	printf("dir %d, name %s, e.in_use %d, e.name %s, e.sector %d at lookup\n", inode_to_sector(dir->inode), name, e.in_use, e.name, e.inode_sector);
 #endif
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
-	}
+      if (e.in_use && !strcmp (name, e.name)) 
+        {
+          if (ep != NULL)
+            *ep = e;
+          if (ofsp != NULL)
+            *ofsp = rec.ofs;
+          found = true;
+          break;
+        }
+    }
+  inode_close (index);
 
-  return false;
+  return found;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -155,15 +594,14 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
-  struct dir_entry e;
+  block_sector_t sector;
+  bool is_dir;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  cached_lookup (dir, name, &sector, &is_dir);
+  *inode = sector != 0 ? inode_open (sector) : NULL;
 
 #ifdef INFO8
 	printf("%p %s\n", *inode, name);
@@ -175,17 +613,15 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_is_dir (const struct dir *dir, const char *name) 
 {
-  struct dir_entry e;
+  block_sector_t sector;
 	bool is_dir=false;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL)){
-		is_dir = e.is_dir;
-	}
+  cached_lookup (dir, name, &sector, &is_dir);
 
-  return is_dir;
+  return sector != 0 && is_dir;
 }
 
 /* Adds a file named NAME to DIR, which must not already contain a
@@ -197,8 +633,10 @@ dir_is_dir (const struct dir *dir, const char *name)
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is_dir)
 {
+  struct dir_header h;
   struct dir_entry e;
-  off_t ofs;
+  struct inode *index;
+  off_t ofs, next_free;
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -208,35 +646,67 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, bool is
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  inode_lock_dir (dir->inode);
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
+  /* Make room in the index first, so that a failure leaves the
+     directory as it was. */
+  if (!read_header (dir, &h))
+    goto done;
+  if ((h.index_cnt + 1) * 4 > h.index_cap * 3 && !grow_index (dir, &h))
+    goto done;
+
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
-
-  /* Write slot. */
+     current end-of-file. */
+  ofs = h.free_ofs;
+  next_free = 0;
+  if (ofs != 0)
+    {
+      if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+        goto done;
+      next_free = e.inode_sector;
+    }
+  else
+    ofs = inode_length (dir->inode);
+
+  /* Index it, then write the slot, taking the record out again if
+     that fails, so that a full disk leaves the directory as it
+     was. */
+  index = inode_open (h.index_sector);
+  if (index == NULL)
+    goto done;
+  success = index_insert (index, h.index_cap, dir_hash (name), ofs);
+  inode_close (index);
+  if (!success)
+    goto done;
+  h.index_cnt++;
+
+  memset (&e, 0, sizeof e);
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
 	e.is_dir = is_dir;
 
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+    {
+      index_delete (&h, dir_hash (name), ofs);
+      success = false;
+      goto done;
+    }
+  h.free_ofs = next_free;
+  success = write_header (dir, &h);
+  dcache_invalidate (inode_get_inumber (dir->inode), name, 0);
 
 #ifdef INFO8
 	printf("succed to add: name %s, dir %d, ofs %d \n", name, inode_to_sector(dir->inode), ofs);
 #endif
 
  done:
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -254,13 +724,32 @@ bool
 dir_remove (struct dir *dir, const char *name) 
 {
   struct dir_entry e;
+  struct dir_header h;
   struct inode *inode = NULL;
-  bool success = false;
+  block_sector_t cwd_parent = 0, sector;
+  bool success = false, is_dir;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  /* A directory's "." and ".." entries stay as long as it does.
+     Refusing them also means the only directory locked below,
+     besides DIR, is a child of it. */
+  if (!strcmp (name, ".") || !strcmp (name, ".."))
+    return false;
+
+  /* Look up the parent of the working directory before locking
+     DIR, which may be that directory. */
+	struct dir* cwd = dir_open(inode_open(thread_current()->cwd_sector));
+	if (cwd != NULL) {
+		cached_lookup (cwd, "..", &sector, &is_dir);
+		cwd_parent = sector;
+	}
+	dir_close(cwd);
+
+  inode_lock_dir (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -268,35 +757,52 @@ dir_remove (struct dir *dir, const char *name)
 	if (e.inode_sector == ROOT_DIR_SECTOR)
 		goto done;
 
+	if (e.inode_sector == cwd_parent)
+		goto done;
+
 	if (e.inode_sector == thread_current()->cwd_sector)
 		thread_current()->cwd_is_removed=true;
 
-	struct dir* cwd = dir_open(inode_open(thread_current()->cwd_sector));
-	if (cwd != NULL) {
-		struct dir_entry ee;
-		off_t ofss;
-  	if(lookup (cwd, "..", &ee, &ofss)
-			&& ee.inode_sector == e.inode_sector){
-			dir_close(cwd);
-			goto done;
-		}
-	}
-	dir_close(cwd);
-
   /* Open inode. */
   inode = inode_open (e.inode_sector);
   if (inode == NULL)
     goto done;
 
-  /* Erase directory entry. */
+  /* Erase directory entry and put it on the free chain, then
+     unindex it, so that a failed write leaves the name in place. */
+  if (!read_header (dir, &h))
+    goto done;
   e.in_use = false;
 	memset(e.name, 0, NAME_MAX+1);
-	e.inode_sector = 0;
+	e.inode_sector = h.free_ofs;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+	index_delete (&h, dir_hash (name), ofs);
+  h.free_ofs = ofs;
+  write_header (dir, &h);
+  dcache_invalidate (inode_get_inumber (dir->inode), name,
+                     e.is_dir ? inode_get_inumber (inode) : 0);
+
+  /* A directory takes its index along, but only once it is
+     released: it may still be open elsewhere, and lookups through
+     those handles use the index until then.  Its lock keeps an
+     entry being added to it from swapping the index meanwhile. */
+  if (e.is_dir)
+    {
+      struct dir *victim = dir_open (inode_reopen (inode));
+      struct dir_header vh;
+      if (victim != NULL)
+        {
+          inode_lock_dir (victim->inode);
+          if (read_header (victim, &vh))
+            inode_set_companion (inode, vh.index_sector);
+          inode_unlock_dir (victim->inode);
+        }
+      dir_close (victim);
+    }
 
 #ifdef INFO16
-	printf("remove succeed at dir %d, target %d\n", inode_to_sector(dir->inode), e.inode_sector);
+	printf("remove succeed at dir %d, target %d\n", inode_to_sector(dir->inode), inode_get_inumber(inode));
 //	struct dir_entry eee;
 //	off_t ofsss;
 //	inode_read_at (dir->inode, &eee, sizeof eee, ofs);
@@ -314,6 +820,7 @@ dir_remove (struct dir *dir, const char *name)
   success = true;
 
  done:
+  inode_unlock_dir (dir->inode);
 #ifdef INFO16
 	printf("dir_remove: success %d\n", success);
 #endif
@@ -333,6 +840,7 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 	printf("dir_readdir: dir %d, inode %p\n", inode_to_sector(dir_get_inode(dir)), dir->inode);
 #endif
 
+  inode_lock_dir (dir->inode);
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
@@ -342,66 +850,113 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 					printf("dir_readdir: inode %d, name %s\n", e.inode_sector, e.name);
 #endif
           strlcpy (name, e.name, NAME_MAX + 1);
+          inode_unlock_dir (dir->inode);
           return true;
         } 
     }
+  inode_unlock_dir (dir->inode);
   return false;
 }
 
 
+/* Copies the path component at *PATHP, after any delimiters, into
+   NAME and advances *PATHP past it.  Returns the component's
+   length, 0 at the end of the path; NAME is left alone if that is
+   more than NAME_MAX. */
+static size_t
+next_component (const char **pathp, char name[NAME_MAX + 1])
+{
+  const char *p = *pathp, *start;
+  size_t len;
+
+  while (*p == DIR_DELIMIT)
+    p++;
+  for (start = p; *p != '\0' && *p != DIR_DELIMIT; p++)
+    continue;
+  len = p - start;
+  if (len <= NAME_MAX)
+    {
+      memcpy (name, start, len);
+      name[len] = '\0';
+    }
+  *pathp = p;
+  return len;
+}
+
+/* Looks NAME up in the directory whose inode is at PARENT, like
+   cached_lookup().  The directory is opened only if the name cache
+   cannot answer. */
+static void
+cached_lookup_sector (block_sector_t parent, const char *name,
+                      block_sector_t *sector, bool *is_dir)
+{
+  struct dir dir;
+
+  if (dcache_get (parent, name, sector, is_dir))
+    return;
+
+  *sector = 0;
+  *is_dir = false;
+  dir.inode = inode_open (parent);
+  if (dir.inode == NULL)
+    return;
+  dir.pos = DIR_ENTRIES_OFS;
+  inode_mark_dir (dir.inode);
+  cached_lookup (&dir, name, sector, is_dir);
+  inode_close (dir.inode);
+}
+
+/* Opens the directory that holds the last component of PATH,
+   walking the components before it from the root or the working
+   directory.  Only sector numbers are carried from one component
+   to the next, so a path the name cache knows opens nothing but
+   the directory returned.  Returns a null pointer if PATH has no
+   components or one of the leading ones is not a directory. */
 struct dir *
 dir_open_recursive (const char* path) {
-	int token_count = count_token(path, DIR_DELIMIT_STR);
-	if (token_count == 0)
+	char name[NAME_MAX + 1];
+	const char *rest = path;
+	block_sector_t sector;
+	bool is_dir;
+	size_t len;
+
+	len = next_component (&rest, name);
+	if (len == 0)
 		return NULL;
 
-	struct dir* curr=NULL;
 	if (is_absolute(path))
-		curr = dir_open_root();
+		sector = ROOT_DIR_SECTOR;
  	else{ 
 		if (thread_current()->cwd_is_removed)
 			return NULL;
-
-		curr = dir_open(inode_open(thread_current()->cwd_sector));
+		sector = thread_current()->cwd_sector;
 	}
-#ifdef INFO16
-	printf("dir_open_recursive: curr %d, token_count %d\n", inode_to_sector(dir_to_inode(curr)), token_count);
-#endif
-	
-	if (token_count == 1)
-		return curr;
-
-  char temp[TOKEN_MAX];
-  memcpy (temp, path, strlen(path)+1);
 
-	int cnt = 0;
-  char *token, *save_ptr;
-  for (token = strtok_r (temp, DIR_DELIMIT_STR, &save_ptr); token != NULL;
- 	 	token = strtok_r (NULL, DIR_DELIMIT_STR, &save_ptr)) {
+	for (;;) {
+		const char *next = rest;
+		char next_name[NAME_MAX + 1];
+		size_t next_len = next_component (&next, next_name);
 
-#ifdef INFO8
-	printf("dir_open_recursive: token %s, cnt %d\n", token, cnt);
-#endif
-		struct inode *inode=NULL;
-		bool dir_find = dir_lookup(curr, token, &inode);
-		dir_close(curr);
+		/* NAME is the last component, to be found in SECTOR. */
+		if (next_len == 0)
+			break;
 
-		if (!dir_find){
+		if (len > NAME_MAX)
+			return NULL;
+		cached_lookup_sector (sector, name, &sector, &is_dir);
+		if (sector == 0 || !is_dir)
 			return NULL;
-		}
-	
-		curr = dir_open(inode);
-		cnt++;
-	
-		if (cnt == token_count-1)
-			break;
-  }
 
 #ifdef INFO8
-	printf("dir_open_recursive in final: curr %d\n", inode_to_sector(dir_to_inode(curr)));
+	printf("dir_open_recursive: token %s, sector %d\n", name, sector);
 #endif
+		len = next_len;
+		if (len <= NAME_MAX)
+			memcpy (name, next_name, len + 1);
+		rest = next;
+	}
 
-	return curr;
+	return dir_open (inode_open (sector));
 }
 
 
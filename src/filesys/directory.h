@@ -14,6 +14,8 @@
 
 struct inode;
 
+void dir_init (void);
+
 /* Opening and closing directories. */
 bool dir_create (block_sector_t sector, size_t entry_cnt, block_sector_t parent);
 bool dir_create_root (block_sector_t sector, size_t entry_cnt);
@@ -117,6 +117,51 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Reads into the CNT buffers in IOV, in order, from FILE,
+   starting at the file's current position.
+   Returns the number of bytes actually read,
+   which may be less than the buffers hold if end of file is reached.
+   Advances FILE's position by the number of bytes read. */
+off_t
+file_readv (struct file *file, const struct iovec *iov, int cnt) 
+{
+  off_t bytes_read = inode_readv_at (file->inode, iov, cnt, file->pos);
+  file->pos += bytes_read;
+  return bytes_read;
+}
+
+/* Writes the CNT buffers in IOV, in order, to FILE,
+   starting at the file's current position.
+   Returns the number of bytes actually written.
+   Advances FILE's position by the number of bytes written. */
+off_t
+file_writev (struct file *file, const struct iovec *iov, int cnt) 
+{
+  off_t bytes_written = inode_writev_at (file->inode, iov, cnt, file->pos);
+  file->pos += bytes_written;
+  return bytes_written;
+}
+
+/* Copies SIZE bytes from SRC to DST, starting at each file's
+   current position, without passing them through a caller's
+   buffer.
+   Returns the number of bytes actually copied,
+   which may be less than SIZE if end of SRC is reached,
+   or -1 if SRC and DST are the same file and the ranges overlap.
+   Advances both positions by the number of bytes copied. */
+off_t
+file_copy (struct file *dst, struct file *src, off_t size) 
+{
+  off_t bytes_copied = inode_copy_at (dst->inode, dst->pos,
+                                      src->inode, src->pos, size);
+  if (bytes_copied > 0)
+    {
+      src->pos += bytes_copied;
+      dst->pos += bytes_copied;
+    }
+  return bytes_copied;
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
@@ -152,6 +197,16 @@ file_length (struct file *file)
   return inode_length (file->inode);
 }
 
+/* Writes FILE's data to disk, and its metadata as well unless
+   DATA_ONLY and the data can be read back without it.  Returns
+   false if some of the data could not be given sectors. */
+bool
+file_sync (struct file *file, bool data_only)
+{
+  ASSERT (file != NULL);
+  return inode_sync (file->inode, data_only);
+}
+
 /* Sets the current position in FILE to NEW_POS bytes from the
    start of the file. */
 void
@@ -5,7 +5,9 @@
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/cache.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 #include "threads/thread.h"
 #include "threads/synch.h"
 #include "threads/malloc.h"
@@ -27,7 +29,9 @@ filesys_init (bool format)
     PANIC ("No file system device found, can't initialize file system.");
 
   inode_init ();
+  dir_init ();
   free_map_init ();
+  journal_init (format);
 
   if (format) 
     do_format ();
@@ -42,6 +46,10 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  /* The last pass may allocate sectors for delayed data, so it has
+     to run while the free map file is still open; it also writes
+     the free map, leaving nothing for free_map_close() to do. */
+  write_dirty_buffer_cache_to_sector ();
   free_map_close ();
 }
 
@@ -61,13 +69,17 @@ filesys_create (const char *name, off_t initial_size)
 
 	char* name_end = get_name_from_end(name);
 
+  journal_begin ();
+
 #ifdef INFO16
 	printf("filesys_create: dir %p\n", dir);
 	printf("filesys_create: parent sector %d, name_end %s\n", inode_to_sector(dir_to_inode(dir)), name_end);
 #endif
 
+  /* Place the inode near its directory's. */
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_run (inode_to_sector (dir_to_inode (dir)), 1,
+                                            &inode_sector, false) == 1
                   && inode_create (inode_sector, initial_size)
                   && dir_add_file (dir, name_end, inode_sector));
 
@@ -78,6 +90,7 @@ filesys_create (const char *name, off_t initial_size)
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
 
 	free(name_end);
 
@@ -98,14 +111,18 @@ filesys_create_dir (const char* name) {
 	printf("filesys_create_dir: parent sector %d, name_end %s\n", inode_to_sector(dir_to_inode(parent)), name_end);
 #endif
 
+  journal_begin ();
+
 	bool success = (parent != NULL
-									&& free_map_allocate(1, &inode_sector)
+									&& free_map_allocate_run(inode_to_sector(dir_to_inode(parent)), 1,
+																					 &inode_sector, false) == 1
 									&& dir_create(inode_sector, 16, inode_to_sector(dir_to_inode(parent)))
                   && dir_add (parent, name_end, inode_sector, true));
 
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
 	dir_close(parent);
+  journal_end ();
 	free(name_end);
 
 	return success;
@@ -206,9 +223,11 @@ filesys_remove (const char *name)
 	printf("filesys_remove: name %s, name_end %s\n", name, name_end);
 #endif
 
+  journal_begin ();
   bool success = dir != NULL && dir_remove (dir, name_end);
 
   dir_close (dir); 
+  journal_end ();
 	free(name_end);
 
   return success;
@@ -219,9 +238,11 @@ static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  journal_begin ();
   free_map_create ();
   if (!dir_create_root (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
+  journal_end ();
   free_map_close ();
   printf ("done.\n");
 }
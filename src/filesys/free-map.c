@@ -1,13 +1,186 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
 
+/* One bit per sector of the free map file, set if the part of
+   free_map stored there has changed since it was last written.
+   free_map_flush() writes just those sectors. */
+#define FREE_MAP_BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+static struct bitmap *free_map_dirty;
+
+/* One bit per sector, set if the sector was released since the
+   last journal commit.  Such a sector stays marked used in
+   free_map until free_map_commit(): the metadata that dropped it
+   is not on disk yet, and a crash would bring it back pointing at
+   whatever a new owner wrote there. */
+static struct bitmap *free_map_pending;
+
+/* Number of free sectors, and how many of them are promised to
+   data whose allocation was put off (see free_map_reserve()).
+   Ordinary allocations may only use the difference. */
+static size_t free_map_free_cnt;
+static size_t free_map_reserved_cnt;
+
+/* Protects the free map, its counters and the free map file. */
+static struct lock free_map_lock;
+
+/* Returns the number of sectors ordinary allocations may use.
+   Sectors allocated against a reservation count as used before
+   the reservation is dropped, so the difference can go negative
+   for a moment.  Must be called with free_map_lock held. */
+static size_t
+free_map_available (void)
+{
+  return free_map_free_cnt > free_map_reserved_cnt
+         ? free_map_free_cnt - free_map_reserved_cnt : 0;
+}
+
+/* Notes that the bits for CNT sectors starting at SECTOR have
+   changed.  Must be called with free_map_lock held. */
+static void
+free_map_mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / FREE_MAP_BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / FREE_MAP_BITS_PER_SECTOR;
+
+  bitmap_set_multiple (free_map_dirty, first, last - first + 1, true);
+}
+
+/* The disk is split into allocation groups of this many sectors,
+   each described by one sector of the free map file.  A group
+   keeps its free sector count, so that full groups are skipped
+   without looking at their bits, and a rotor where the last
+   allocation in it ended, where the next search in it starts. */
+#define FREE_MAP_GROUP_SECTORS FREE_MAP_BITS_PER_SECTOR
+
+struct free_map_group
+  {
+    size_t free_cnt;                    /* Free sectors in the group. */
+    size_t rotor;                       /* Where to start searching. */
+  };
+
+static struct free_map_group *free_map_groups;
+static size_t free_map_group_cnt;
+
+/* Returns the first sector of group G. */
+static size_t
+group_start (size_t g)
+{
+  return g * FREE_MAP_GROUP_SECTORS;
+}
+
+/* Returns the sector just past group G. */
+static size_t
+group_end (size_t g)
+{
+  size_t end = (g + 1) * FREE_MAP_GROUP_SECTORS;
+  size_t size = bitmap_size (free_map);
+
+  return end < size ? end : size;
+}
+
+/* Recounts the free sectors of every group and resets the
+   rotors, after the whole free map was loaded. */
+static void
+free_map_count_groups (void)
+{
+  size_t g;
+
+  free_map_free_cnt = 0;
+  for (g = 0; g < free_map_group_cnt; g++)
+    {
+      free_map_groups[g].free_cnt = bitmap_count (free_map, group_start (g),
+                                                  group_end (g) - group_start (g),
+                                                  false);
+      free_map_groups[g].rotor = group_start (g);
+      free_map_free_cnt += free_map_groups[g].free_cnt;
+    }
+}
+
+/* Updates the free counts for CNT sectors starting at SECTOR,
+   which may span groups, having just been freed if FREED is true
+   or taken otherwise. */
+static void
+free_map_adjust (block_sector_t sector, size_t cnt, bool freed)
+{
+  size_t g, end = sector + cnt, n;
+
+  for (g = sector / FREE_MAP_GROUP_SECTORS; sector < end; g++)
+    {
+      n = (group_end (g) < end ? group_end (g) : end) - sector;
+      if (freed)
+        free_map_groups[g].free_cnt += n;
+      else
+        free_map_groups[g].free_cnt -= n;
+      sector += n;
+    }
+  if (freed)
+    free_map_free_cnt += cnt;
+  else
+    free_map_free_cnt -= cnt;
+}
+
+/* Marks CNT sectors starting at SECTOR used, and moves the rotor
+   of the group the run ends in past it. */
+static void
+free_map_take (block_sector_t sector, size_t cnt)
+{
+  size_t g = (sector + cnt - 1) / FREE_MAP_GROUP_SECTORS;
+
+  bitmap_set_multiple (free_map, sector, cnt, true);
+  free_map_mark_dirty (sector, cnt);
+  free_map_adjust (sector, cnt, false);
+  free_map_groups[g].rotor = sector + cnt < group_end (g)
+                             ? sector + cnt : group_start (g);
+}
+
+/* Returns the first sector at or after START from which CNT
+   sectors before END are all free, or BITMAP_ERROR. */
+static size_t
+free_map_scan_range (size_t start, size_t end, size_t cnt)
+{
+  return bitmap_scan_range (free_map, start, end, cnt, false);
+}
+
+/* Finds CNT free sectors in a row, looking in the group of HINT
+   first, starting at HINT, and then in the groups after it,
+   starting at their rotors.  Groups with too few free sectors
+   are passed over on their counts alone, so the cost does not
+   grow as the disk fills.  Returns the first sector, or
+   BITMAP_ERROR if no group has such a run. */
+static size_t
+free_map_find (block_sector_t hint, size_t cnt)
+{
+  size_t g0 = hint / FREE_MAP_GROUP_SECTORS, g, i, from, sector;
+
+  for (i = 0; i < free_map_group_cnt; i++)
+    {
+      g = (g0 + i) % free_map_group_cnt;
+      if (free_map_groups[g].free_cnt < cnt)
+        continue;
+
+      from = i == 0 ? hint : free_map_groups[g].rotor;
+      sector = free_map_scan_range (from, group_end (g), cnt);
+      if (sector == BITMAP_ERROR && from > group_start (g))
+        sector = free_map_scan_range (group_start (g),
+                                      from + cnt - 1 < group_end (g)
+                                      ? from + cnt - 1 : group_end (g), cnt);
+      if (sector != BITMAP_ERROR)
+        return sector;
+    }
+  return BITMAP_ERROR;
+}
+
 /* Initializes the free map. */
 void
 free_map_init (void) 
@@ -17,36 +190,209 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  free_map_dirty = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                                BLOCK_SECTOR_SIZE));
+  free_map_pending = bitmap_create (bitmap_size (free_map));
+  if (free_map_dirty == NULL || free_map_pending == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  free_map_group_cnt = DIV_ROUND_UP (bitmap_size (free_map), FREE_MAP_GROUP_SECTORS);
+  free_map_groups = malloc (free_map_group_cnt * sizeof *free_map_groups);
+  if (free_map_groups == NULL)
+    PANIC ("allocation group creation failed");
+  free_map_count_groups ();
+  lock_init (&free_map_lock);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP.  The search starts at the rotor of the
+   first group.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector = BITMAP_ERROR;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_available () >= cnt)
+    sector = free_map_find (free_map_groups[0].rotor, cnt);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      free_map_take (sector, cnt);
+      *sectorp = sector;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+  lock_release (&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates between 1 and CNT consecutive sectors and stores the
+   first into *SECTORP, preferring a run that starts at HINT so that
+   a growing file stays contiguous.  Failing that, the first run of
+   CNT sectors near HINT is used, as free_map_find() looks for it,
+   and if there is none, whatever run starts at the first free
+   sector after HINT.  Callers pass the sector after a file's last
+   one for its data and the parent directory's inode for a new
+   inode, so that related sectors end up in the same group.
+   If RESERVED is true, the caller holds a reservation made with
+   free_map_reserve() that covers the sectors, and they may come out
+   of reserved space; the caller drops the reservation afterward.
+   Returns the number of sectors allocated, which is 0 if the disk
+   is full. */
+size_t
+free_map_allocate_run (block_sector_t hint, size_t cnt, block_sector_t *sectorp,
+                       bool reserved)
+{
+  size_t size = bitmap_size (free_map);
+  size_t sector, run, avail;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  avail = reserved ? free_map_free_cnt : free_map_available ();
+  if (cnt > avail)
+    cnt = avail;
+  if (cnt == 0)
+    {
+      lock_release (&free_map_lock);
+      return 0;
+    }
+
+  if (hint >= size)
+    hint = 0;
+  if (!bitmap_test (free_map, hint))
+    sector = hint;
+  else
+    {
+      sector = free_map_find (hint, cnt);
+      if (sector == BITMAP_ERROR)
+        sector = free_map_find (hint, 1);
+      if (sector == BITMAP_ERROR)
+        {
+          lock_release (&free_map_lock);
+          return 0;
+        }
+    }
+
+  for (run = 1; run < cnt && sector + run < size; run++)
+    if (bitmap_test (free_map, sector + run))
+      break;
+
+  free_map_take (sector, run);
+  lock_release (&free_map_lock);
+  *sectorp = sector;
+  return run;
+}
+
+/* Sets aside CNT free sectors for data whose sectors will be
+   allocated later with free_map_allocate_run(..., true), so that the
+   allocation cannot fail for lack of space.  Returns false if there
+   are not that many sectors left that are neither used nor
+   reserved. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = free_map_available () >= cnt;
+  if (success)
+    free_map_reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Drops a reservation of CNT sectors made by free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (free_map_reserved_cnt >= cnt);
+  free_map_reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Makes CNT sectors starting at SECTOR available for use.  While
+   metadata is journaled, that happens only at the next commit; see
+   free_map_pending. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  if (journal_active ())
+    {
+      ASSERT (bitmap_none (free_map_pending, sector, cnt));
+      bitmap_set_multiple (free_map_pending, sector, cnt, true);
+    }
+  else
+    {
+      bitmap_set_multiple (free_map, sector, cnt, false);
+      free_map_mark_dirty (sector, cnt);
+      free_map_adjust (sector, cnt, true);
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Frees the sectors released since the last commit and writes the
+   changed parts of the free map, so that both go into the
+   transaction being committed.  Called by journal_commit() once no
+   handle is open. */
+void
+free_map_commit (void)
+{
+  size_t cnt = bitmap_size (free_map_pending), start, end;
+
+  lock_acquire (&free_map_lock);
+  for (start = 0; start < cnt; start = end)
+    {
+      start = bitmap_scan (free_map_pending, start, 1, true);
+      if (start == BITMAP_ERROR)
+        break;
+      for (end = start + 1; end < cnt; end++)
+        if (!bitmap_test (free_map_pending, end))
+          break;
+      bitmap_set_multiple (free_map_pending, start, end - start, false);
+      bitmap_set_multiple (free_map, start, end - start, false);
+      free_map_mark_dirty (start, end - start);
+      free_map_adjust (start, end - start, true);
+    }
+  lock_release (&free_map_lock);
+
+  free_map_flush ();
+}
+
+/* Writes the parts of the free map that changed since the last
+   call to the free map file, one run of dirty sectors at a time.
+   The dirty writer calls this before each pass, so the free map
+   goes to disk in the same batch as the data it describes. */
+void
+free_map_flush (void)
+{
+  size_t cnt, start, end;
+
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    {
+      cnt = bitmap_size (free_map_dirty);
+      for (start = 0; start < cnt; start = end)
+        {
+          start = bitmap_scan (free_map_dirty, start, 1, true);
+          if (start == BITMAP_ERROR)
+            break;
+          for (end = start + 1; end < cnt; end++)
+            if (!bitmap_test (free_map_dirty, end))
+              break;
+          if (!bitmap_write_partial (free_map, free_map_file,
+                                     start * BLOCK_SECTOR_SIZE,
+                                     (end - start) * BLOCK_SECTOR_SIZE))
+            break;
+          bitmap_set_multiple (free_map_dirty, start, end - start, false);
+        }
+    }
+  lock_release (&free_map_lock);
+  journal_end ();
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +404,22 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  free_map_count_groups ();
+  bitmap_set_all (free_map_dirty, false);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
-  file_close (free_map_file);
+  struct file *file;
+
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
+  file = free_map_file;
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
+  file_close (file);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -82,4 +437,5 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (free_map_dirty, false);
 }
@@ -12,6 +12,11 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+size_t free_map_allocate_run (block_sector_t, size_t, block_sector_t *, bool);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
 void free_map_release (block_sector_t, size_t);
+void free_map_flush (void);
+void free_map_commit (void);
 
 #endif /* filesys/free-map.h */
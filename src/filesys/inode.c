@@ -1,17 +1,53 @@
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/cache.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
-#define ID_FIRST_SIZE 126
+
+/* Block map.  The first ID_DIRECT_CNT data sectors are listed in
+   the inode itself; the following ones are reached through one
+   single, one double and one triple indirect block, each level
+   fanning out ID_SECOND_SIZE ways.  That is a little over 1 GB.
+   With the length, magic and flags words in front, 122 direct and
+   3 indirect pointers fill the 128 words of the inode sector. */
+#define ID_DIRECT_CNT 122
 #define ID_SECOND_SIZE 128
+#define ID_INDIRECT_LEVELS 3
+#define ID_MAX_SECTORS (ID_DIRECT_CNT + ID_SECOND_SIZE \
+                        + ID_SECOND_SIZE * ID_SECOND_SIZE \
+                        + ID_SECOND_SIZE * ID_SECOND_SIZE * ID_SECOND_SIZE)
+
+/* Files no longer than this keep their data in the inode sector,
+   in place of the block map, and have no data sectors at all.  A
+   write past it moves the data to a regular data sector. */
+#define INODE_INLINE_MAX 500
+
+/* Inode flags. */
+#define INODE_INLINE 0x1                /* Data is in inline_data. */
+
+/* Read-ahead window, in sectors, for a sequentially read inode.
+   It starts at the minimum, doubles on every further sequential
+   read and is capped by the cache's read-ahead limit. */
+#define READ_AHEAD_MIN_WINDOW 2
+#define READ_AHEAD_MAX_WINDOW 16
+
+/* Data written into a hole gets its sector when it is written
+   back rather than when it is written, so that sectors written one
+   at a time can still be allocated as one run.  Until then it is
+   cached under a virtual sector number, which pins a cache slot;
+   no more than this many sectors, over all inodes, wait at once. */
+#define INODE_DELAYED_MAX (get_buffer_cache_size () / 4)
 
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
@@ -19,14 +55,47 @@ struct inode_disk_first
   {
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    block_sector_t id_second_table[ID_FIRST_SIZE];      /* Not used. */
+    unsigned flags;                     /* INODE_* flags. */
+    union
+      {
+        struct
+          {
+            block_sector_t direct_table[ID_DIRECT_CNT];          /* Data sectors. */
+            block_sector_t indirect_table[ID_INDIRECT_LEVELS];   /* Single, double
+                                                                    and triple
+                                                                    indirect. */
+          };
+        uint8_t inline_data[INODE_INLINE_MAX];  /* With INODE_INLINE. */
+      };
   };
 
+/* Indirect block. */
 struct inode_disk_second
   {
-    block_sector_t data_table[ID_SECOND_SIZE];      /* First data sector. */
+    block_sector_t data_table[ID_SECOND_SIZE];      /* Next level sectors. */
   };
 
+/* Returns the number of sectors to allocate for an inode SIZE
+   bytes long. */
+static inline size_t
+bytes_to_sectors (off_t size)
+{
+  return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
+}
+
+static int offset_to_path (off_t, int[ID_INDIRECT_LEVELS]);
+static block_sector_t read_table_entry (block_sector_t, int);
+static block_sector_t allocate_table (block_sector_t, bool);
+static int offset_to_sector_pinned (struct inode_disk_first *, off_t, struct buffer_cache **);
+static bool allocate_sector_range (struct inode_disk_first *, block_sector_t, off_t, off_t);
+static int offset_to_sector_with_expand_second (struct inode_disk_first *, block_sector_t, off_t, block_sector_t, struct buffer_cache **, bool);
+static off_t id_first_sector_length (const struct inode_disk_first *);
+static off_t table_sector_length (block_sector_t, int);
+static void release_table (block_sector_t, int);
+static bool inode_migrate_inline (struct inode *);
+static off_t do_readv_at (struct inode *, const struct iovec *, int, off_t);
+static off_t do_writev_at (struct inode *, const struct iovec *, int, off_t);
+
 struct inode_disk_first*
 new_inode_disk_first(off_t length) {
 	struct inode_disk_first* id_first=calloc(1, sizeof(struct inode_disk_first));
@@ -34,7 +103,8 @@ new_inode_disk_first(off_t length) {
 	id_first->length = length;
 	id_first->magic = INODE_MAGIC;
 
-	memset(id_first->id_second_table, 0, ID_FIRST_SIZE * sizeof(block_sector_t) );
+	memset(id_first->direct_table, 0, ID_DIRECT_CNT * sizeof(block_sector_t) );
+	memset(id_first->indirect_table, 0, ID_INDIRECT_LEVELS * sizeof(block_sector_t) );
 
 	return id_first;
 }
@@ -48,119 +118,233 @@ new_inode_disk_second(void) {
 	return id_second;
 }
 
-char*
-new_zeros_sector(void){
-	char* zeros = malloc(BLOCK_SECTOR_SIZE);
-	memset(zeros, 0, ID_SECOND_SIZE * sizeof(block_sector_t) );
-
-	return zeros;
-}
-
 void
 test_zero_sector_size(void){
 #ifdef INFO5
-	struct buffer_cache* bc2 = get_buffer_cache_value_from_sector(0);
+	struct buffer_cache* bc2 = pin_buffer_cache_from_sector(0, BC_CLASS_INODE);
 	struct inode_disk_first* id_first=(struct inode_disk_first*)(bc2->data);
 	ASSERT(id_first->magic == INODE_MAGIC);
 	printf("sector 0 test with length %d\n", id_first->length);
-	free(bc2);
+	unpin_buffer_cache(bc2);
 #endif
 }
 
+/* Works out where data sector OFFSET is mapped.  Returns 0 if it
+   is in the direct table, at index IDX[0], or the number of
+   indirect levels to go through, in which case IDX[] receives the
+   index into each indirect block, top level first.  Returns -1 if
+   OFFSET is past the largest possible file. */
+static int
+offset_to_path(off_t offset, int idx[ID_INDIRECT_LEVELS]){
+	off_t span = ID_SECOND_SIZE;
+	int level, k;
+
+	if (offset < 0)
+		return -1;
+	if (offset < ID_DIRECT_CNT) {
+		idx[0] = offset;
+		return 0;
+	}
+	offset -= ID_DIRECT_CNT;
+
+	for (level = 1; level <= ID_INDIRECT_LEVELS; level++) {
+		if (offset < span) {
+			for (k = level - 1; k >= 0; k--) {
+				idx[k] = offset % ID_SECOND_SIZE;
+				offset /= ID_SECOND_SIZE;
+			}
+			return level;
+		}
+		offset -= span;
+		span *= ID_SECOND_SIZE;
+	}
+	return -1;
+}
+
+/* Returns entry IDX of the indirect block at SECTOR. */
+static block_sector_t
+read_table_entry(block_sector_t sector, int idx){
+	block_sector_t entry;
+
+	read_buffer_cache_to_dst_from_sector(sector, idx * sizeof entry, &entry, sizeof entry, BC_CLASS_INDIRECT);
+	return entry;
+}
+
+/* Allocates an empty indirect block as close after HINT as
+   possible and returns its sector, or 0 if the disk is full.
+   RESERVED is as for free_map_allocate_run(). */
+static block_sector_t
+allocate_table(block_sector_t hint, bool reserved){
+	block_sector_t sector;
+
+	if (free_map_allocate_run (hint, 1, &sector, reserved) == 0)
+		return 0;
+	unpin_buffer_cache(pin_new_buffer_cache_from_sector(sector, BC_CLASS_INDIRECT));
+	return sector;
+}
 
+/* Returns the data sector at sector OFFSET of the file whose
+   inode, stored at ID_FIRST_SECTOR, is ID_FIRST, allocating it if
+   it is missing.  Sectors before it that are missing stay holes.
+   ID_FIRST is an in-memory copy; changes to it are written through
+   to the cache.  Returns -1 if the disk is full or OFFSET is past
+   the largest possible file. */
 int
-offset_to_sector_with_expand(block_sector_t id_first_sector, off_t offset){
-	int i=0, ret=0;
+offset_to_sector_with_expand(struct inode_disk_first* id_first, block_sector_t id_first_sector, off_t offset){
+	if (!allocate_sector_range(id_first, id_first_sector, offset, offset))
+		return -1;
+	return offset_to_sector(id_first, offset);
+}
 
-	struct buffer_cache* bc = get_buffer_cache_value_from_sector(id_first_sector);
-	struct inode_disk_first* id_first=(struct inode_disk_first*)(bc->data);
-	struct inode_disk_second* zeros=(struct inode_disk_second*)new_zeros_sector();
+/* Allocates the sectors from FIRST to LAST, inclusive, of the file
+   whose inode, stored at ID_FIRST_SECTOR, is ID_FIRST, that are
+   still missing.  Each stretch of missing sectors is requested as
+   one run that continues the sector before it, if there is one,
+   and filled with as few runs as the free map can give.
+   Returns false if the range is past the largest possible file or
+   the disk fills up, in which case only part of it was allocated. */
+static bool
+allocate_sector_range(struct inode_disk_first* id_first, block_sector_t id_first_sector, off_t first, off_t last){
+	struct buffer_cache* bc = NULL;
+	block_sector_t run, hint = id_first_sector + 1;
+	off_t next, end;
+	size_t got, k;
+	int prev;
+	bool success = true;
 
 	ASSERT(id_first->magic == INODE_MAGIC);
+	ASSERT(!(id_first->flags & INODE_INLINE));
+
+	if (first < 0 || last >= ID_MAX_SECTORS)
+		return false;
 
 #ifdef INFO5
 	printf("inode sector at expand_first: %d with length %d\n", id_first_sector, id_first->length );
 #endif
 
-	for(i=0; i<ID_FIRST_SIZE; i++){
-		if (id_first->id_second_table[i] == 0){
-			block_sector_t id_second_sector;
-			if(!free_map_allocate (1, &id_second_sector)){
-				free(bc);
-				free(zeros);
-				return -1;
-			}
-			id_first->id_second_table[i] = id_second_sector;
-			write_src_to_buffer_cache_from_sector(id_first_sector, 0, id_first, BLOCK_SECTOR_SIZE);
-			write_src_to_buffer_cache_from_sector(id_first->id_second_table[i], 0, zeros, BLOCK_SECTOR_SIZE);
-		}
+	if (first > 0 && (prev = offset_to_sector_pinned(id_first, first - 1, &bc)) != -1)
+		hint = prev + 1;
 
-#ifdef INFO5
-		printf("id_first idx at expand_first: %d, and its id_second_sector: %d\n", i, id_first->id_second_table[i]);
-#endif
-		ret = offset_to_sector_with_expand_second(id_first->id_second_table[i], &offset);
-		if (ret==-1){
-			free(bc);
-			free(zeros);
-			return -1;
-		}
-		else if (ret!=0){
-			free(bc);
-			free(zeros);
-			return ret;
+	for (next = first; next <= last; ) {
+		prev = offset_to_sector_pinned(id_first, next, &bc);
+		if (prev != -1) {
+			hint = prev + 1;
+			next++;
+			continue;
 		}
-	}		
 
-	free(bc);
-	free(zeros);
-	PANIC("failed to find block_sector_t at offset_to_sector_with_expand");
+		for (end = next + 1; end <= last; end++)
+			if (offset_to_sector_pinned(id_first, end, &bc) != -1)
+				break;
 
-	return -1;
+		while (next < end) {
+			got = free_map_allocate_run(hint, end - next, &run, false);
+			if (got == 0) {
+				success = false;
+				goto done;
+			}
+			for (k = 0; k < got; k++) {
+				unpin_buffer_cache(pin_new_buffer_cache_from_sector(run + k, BC_CLASS_DATA));
+				if (offset_to_sector_with_expand_second(id_first, id_first_sector, next + k, run + k, &bc, false) == -1) {
+					free_map_release(run + k, got - k);
+					success = false;
+					goto done;
+				}
+			}
+			next += got;
+			hint = run + got;
+		}
+	}
+
+done:
+	if (bc != NULL)
+		unpin_buffer_cache(bc);
+	return success;
 }
 
-int
-offset_to_sector_with_expand_second(block_sector_t id_second_sector, off_t* offset){
-	int i=0, ret=0;
-	char *zeros = new_zeros_sector();
- 	struct buffer_cache* bc = get_buffer_cache_value_from_sector(id_second_sector);
-	struct inode_disk_second* id_second=(struct inode_disk_second*)(bc->data);
-
-	for(i=0; i<ID_SECOND_SIZE; i++){
-		if (id_second->data_table[i]==0){
-			block_sector_t data_sector;
-			if(!free_map_allocate (1, &data_sector)){
-				free(bc);
-				free(zeros);
+/* Installs the newly allocated DATA_SECTOR as sector OFFSET of
+   the file whose inode, stored at ID_FIRST_SECTOR, is ID_FIRST,
+   allocating the indirect blocks on the way if needed, and
+   returns it.  The last indirect block is kept pinned in *BC as in
+   offset_to_sector_pinned().  RESERVED lets the indirect blocks
+   come out of reserved space.  Returns -1 if the disk is full. */
+static int
+offset_to_sector_with_expand_second(struct inode_disk_first* id_first, block_sector_t id_first_sector, off_t offset, block_sector_t data_sector, struct buffer_cache** bc, bool reserved){
+	int idx[ID_INDIRECT_LEVELS], level = offset_to_path(offset, idx), k;
+	block_sector_t table, entry;
+
+	ASSERT(level >= 0);
+
+	if (level == 0) {
+		ASSERT(id_first->direct_table[idx[0]] == 0);
+		id_first->direct_table[idx[0]] = data_sector;
+		write_src_to_buffer_cache_from_sector(id_first_sector,
+				offsetof (struct inode_disk_first, direct_table[idx[0]]),
+				&data_sector, sizeof data_sector, BC_CLASS_INODE);
+		return data_sector;
+	}
+
+	table = id_first->indirect_table[level - 1];
+	if (table == 0) {
+		if ((table = allocate_table(data_sector, reserved)) == 0)
+			return -1;
+		id_first->indirect_table[level - 1] = table;
+		write_src_to_buffer_cache_from_sector(id_first_sector,
+				offsetof (struct inode_disk_first, indirect_table[level - 1]),
+				&table, sizeof table, BC_CLASS_INODE);
+	}
+	for (k = 0; k < level - 1; k++) {
+		entry = read_table_entry(table, idx[k]);
+		if (entry == 0) {
+			if ((entry = allocate_table(data_sector, reserved)) == 0)
 				return -1;
-			}
-			id_second->data_table[i] = data_sector;
-			write_src_to_buffer_cache_from_sector(id_second_sector, 0, id_second, BLOCK_SECTOR_SIZE);
-			write_src_to_buffer_cache_from_sector(id_second->data_table[i], 0, zeros, BLOCK_SECTOR_SIZE);
+			write_src_to_buffer_cache_from_sector(table, idx[k] * sizeof entry,
+					&entry, sizeof entry, BC_CLASS_INDIRECT);
 		}
+		table = entry;
+	}
 
-#ifdef INFO5
-		printf("id_second idx : %d -> data_sector %d\n", i, id_second->data_table[i]);
-#endif
+	if (*bc != NULL && (*bc)->sector_idx != table) {
+		unpin_buffer_cache(*bc);
+		*bc = NULL;
+	}
+	if (*bc == NULL)
+		*bc = pin_buffer_cache_from_sector(table, BC_CLASS_INDIRECT);
+
+	struct inode_disk_second* id_second = (struct inode_disk_second*)((*bc)->data);
+	k = idx[level - 1];
+	ASSERT(id_second->data_table[k] == 0);
 
-		if((*offset)==0){
+	lock_acquire(&(*bc)->lock);
+	id_second->data_table[k] = data_sector;
+	lock_release(&(*bc)->lock);
+	set_buffer_cache_dirty(*bc);
 #ifdef INFO5
-		printf("id_second idx : %d -> data_sector %d when return\n", i, id_second->data_table[i]);
+	printf("level %d idx %d -> data_sector %d\n", level, k, data_sector);
 #endif
-			ret = id_second->data_table[i];
-			free(bc);
-			free(zeros);
-			return ret;
-		}
-		(*offset)--;
-	}
 
-	free(bc);
-	free(zeros);
-	return ret;
+	return data_sector;
 }
 
+/* Returns the data sector at sector OFFSET of the file whose
+   inode is ID_FIRST, or -1 if it has not been allocated. */
 int
 offset_to_sector(struct inode_disk_first* id_first, off_t offset)
+{
+	struct buffer_cache* bc = NULL;
+	int ret = offset_to_sector_pinned(id_first, offset, &bc);
+
+	if (bc != NULL)
+		unpin_buffer_cache(bc);
+	return ret;
+}
+
+/* Like offset_to_sector(), but leaves the last indirect block it
+   used pinned in *BC and reuses *BC if it already is the right
+   one, so that a caller walking consecutive sectors pins each
+   last-level block once.  The caller unpins *BC when done. */
+static int
+offset_to_sector_pinned(struct inode_disk_first* id_first, off_t offset, struct buffer_cache** bc)
 {
 #ifdef INFO4
 	printf("offset_to_sector with offset %d\n", offset);
@@ -168,74 +352,170 @@ offset_to_sector(struct inode_disk_first* id_first, off_t offset)
 
 	ASSERT(id_first->magic==INODE_MAGIC);
 
-	int i=0, j=0, ret=-1;
-	off_t remain_offset=offset;
- 	struct buffer_cache* bc=NULL;
-	struct inode_disk_second* id_second;
- 
-	for(i=0; i<ID_FIRST_SIZE; i++){
-#ifdef INFO14
-		printf("offset_to_sector: %d\n", id_first->id_second_table[i]);
-#endif
-		if (id_first->id_second_table[i] == 0){
-			free(bc);
-			break;
-		}
+	int idx[ID_INDIRECT_LEVELS], level = offset_to_path(offset, idx), k;
+	block_sector_t table;
+	int ret;
+
+	if (level < 0 || (id_first->flags & INODE_INLINE))
+		return -1;
+	if (level == 0) {
+		ret = id_first->direct_table[idx[0]];
+		return ret != 0 ? ret : -1;
+	}
+
+	table = id_first->indirect_table[level - 1];
+	for (k = 0; k < level - 1 && table != 0; k++)
+		table = read_table_entry(table, idx[k]);
+	if (table == 0)
+		return -1;
 
-		block_sector_t id_second_sector = id_first->id_second_table[i];
-		bc = get_buffer_cache_value_from_sector(id_second_sector);	
-		id_second = (struct inode_disk_second*)(bc->data);
+	if (*bc != NULL && (*bc)->sector_idx != table) {
+		unpin_buffer_cache(*bc);
+		*bc = NULL;
+	}
+	if (*bc == NULL)
+		*bc = pin_buffer_cache_from_sector(table, BC_CLASS_INDIRECT);
 
-		for(j=0; j<ID_SECOND_SIZE; j++){
-			if(id_second->data_table[j]!=0 && remain_offset==0){
-				ret=id_second->data_table[j];
-				free(bc);
+	struct inode_disk_second* id_second = (struct inode_disk_second*)((*bc)->data);
+	ret = id_second->data_table[idx[level - 1]];
 #ifdef INFO3
-	printf("offset_to_sector i: %d, j: %d, ret: %d\n", i, j, ret);
+	printf("offset_to_sector level: %d, idx: %d, ret: %d\n", level, idx[level - 1], ret);
 #endif
-				return ret;
-			}
-			if (id_second->data_table[j]!=0){
-				remain_offset--;
-			}
-		}
-		free(bc);
-	}
+	return ret != 0 ? ret : -1;
+}
 
-//		PANIC("offset is over the length of inode: remain_offset %d\n", remain_offset);
+/* Frees the indirect block at SECTOR, LEVEL levels above the
+   data, together with everything it points to. */
+static void
+release_table(block_sector_t sector, int level){
+	struct buffer_cache* bc = pin_buffer_cache_from_sector(sector, BC_CLASS_INDIRECT);
+	struct inode_disk_second* id_second = (struct inode_disk_second*)(bc->data);
+	int i;
+
+	for (i = 0; i < ID_SECOND_SIZE; i++) {
+		block_sector_t entry = id_second->data_table[i];
+		if (entry == 0)
+			continue;
+		if (level > 1)
+			release_table(entry, level - 1);
+		else
+			free_map_release(entry, 1);
+	}
+	unpin_buffer_cache(bc);
+	free_map_release(sector, 1);
+}
 
-	return -1;
+/* Returns the number of data sectors below the indirect block at
+   SECTOR, LEVEL levels above the data. */
+static off_t
+table_sector_length(block_sector_t sector, int level){
+	struct buffer_cache* bc = pin_buffer_cache_from_sector(sector, BC_CLASS_INDIRECT);
+	struct inode_disk_second* id_second = (struct inode_disk_second*)(bc->data);
+	off_t length = 0;
+	int i;
+
+	for (i = 0; i < ID_SECOND_SIZE; i++) {
+		block_sector_t entry = id_second->data_table[i];
+		if (entry == 0)
+			continue;
+		length += level > 1 ? table_sector_length(entry, level - 1) : 1;
+	}
+	unpin_buffer_cache(bc);
+	return length;
 }
 
 
 
-/* Returns the number of sectors to allocate for an inode SIZE
-   bytes long. */
-static inline size_t
-bytes_to_sectors (off_t size)
-{
-  return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
-}
-
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* Still being read in? */
+    bool closing;                       /* Last opener releasing it? */
     bool removed;                       /* True if deleted, false otherwise. */
+    block_sector_t companion;           /* Inode deleted along with it, or 0. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    off_t ra_next_sector;               /* Where a sequential read starts. */
+    off_t ra_issued_sector;             /* Last sector queued for read-ahead. */
+    int ra_window;                      /* Read-ahead window, 0 if random. */
+    bool is_dir;                        /* Opened as a directory. */
+    struct lock lock;                   /* Protects data and file growth. */
+    struct lock dir_lock;               /* Serializes directory changes. */
+    struct inode_disk_first data;       /* Write-through copy of the inode. */
+    struct list delayed_list;           /* Sectors not allocated yet. */
+    size_t delayed_reserved;            /* Free map sectors reserved for them. */
+    struct list_elem delayed_elem;      /* Element in delayed_inodes. */
+    bool delayed_queued;                /* On delayed_inodes? */
+    bool meta_dirty;                    /* Block map or length changed. */
   };
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* A data sector of an inode that has been written but not yet
+   allocated.  Its data is cached under a virtual sector. */
+struct delayed_sector
+  {
+    struct list_elem elem;              /* Element in delayed_list. */
+    off_t offset;                       /* Sector offset in the file. */
+    block_sector_t sector;              /* Virtual sector holding the data. */
+  };
+
+static void inode_read_ahead (struct inode *, off_t start, off_t end);
+static int inode_lookup_sector (struct inode *, off_t, struct buffer_cache **);
+static int inode_delay_sector (struct inode *, off_t);
+static bool inode_resolve_delayed (struct inode *);
+static void inode_discard_delayed (struct inode *);
+
+/* Returns the buffer cache class of INODE's data sectors. */
+static enum buffer_cache_class
+inode_data_class (const struct inode *inode)
+{
+  if (inode->sector == FREE_MAP_SECTOR)
+    return BC_CLASS_FREE_MAP;
+  return inode->is_dir ? BC_CLASS_DIR : BC_CLASS_DATA;
+}
+
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  open_inodes_lock
+   protects the table and the open counts.  An inode is in the
+   table while its sector is read in, with LOADING set, and while
+   its last opener releases it, with CLOSING set; other openers
+   wait on open_inodes_changed for either to clear. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+static struct condition open_inodes_changed;
+
+static unsigned
+open_inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+static bool
+open_inode_less (const struct hash_elem *a, const struct hash_elem *b,
+                 void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->sector
+         < hash_entry (b, struct inode, elem)->sector;
+}
+
+/* Inodes with a nonempty delayed_list, and the number of delayed
+   sectors over all of them.  An inode synced since it was queued
+   may be on the list with nothing left to allocate; delayed_queued
+   tells whether it is on the list. */
+static struct list delayed_inodes;
+static int delayed_cnt;
+static struct lock delayed_lock;
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  hash_init (&open_inodes, open_inode_hash, open_inode_less, NULL);
+  lock_init (&open_inodes_lock);
+  cond_init (&open_inodes_changed);
+  list_init (&delayed_inodes);
+  lock_init (&delayed_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -248,38 +528,45 @@ inode_create (block_sector_t sector, off_t length){
   ASSERT (length >= 0);
   ASSERT (sizeof(struct inode_disk_first) == BLOCK_SECTOR_SIZE)
 
-	struct inode_disk_first* id_first = new_inode_disk_first(length);
-	write_src_to_buffer_cache_from_sector(sector, 0, id_first, BLOCK_SECTOR_SIZE);
-	ASSERT(id_first->magic==INODE_MAGIC);
-	free(id_first);
-
-	if(length == 0){
+	/* A small file needs nothing but its inode sector. */
+	if (length <= INODE_INLINE_MAX) {
+		struct inode_disk_first* id_first = new_inode_disk_first(length);
+		id_first->flags = INODE_INLINE;
+		write_src_to_buffer_cache_from_sector(sector, 0, id_first, BLOCK_SECTOR_SIZE, BC_CLASS_INODE);
+		free(id_first);
 		return true;
 	}
 
+	/* Sectors for LENGTH bytes are allocated up front, so that a
+		 file created with a size owns the space; holes only come from
+		 writes past the end of file.  The free map file relies on
+		 this, since writing it must never allocate. */
+	struct inode_disk_first* id_first = new_inode_disk_first(0);
+	write_src_to_buffer_cache_from_sector(sector, 0, id_first, BLOCK_SECTOR_SIZE, BC_CLASS_INODE);
+	ASSERT(id_first->magic==INODE_MAGIC);
+
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
 
   size_t sectors = bytes_to_sectors (length);
-	off_t offset_sectors = sectors-1;
-	int data_sector = offset_to_sector_with_expand(sector, offset_sectors);
-	if (data_sector==-1){
+	if (!allocate_sector_range(id_first, sector, 0, sectors - 1)){
+		free(id_first);
 		return false;
 	}
 #ifdef INFO5
 	printf("inode %d create with sectors %d, length %d\n", sector, sectors, length);
 #endif
-	ASSERT (data_sector != 0);
 
-	struct inode inode;
-	inode.sector = sector;
+	id_first->length = length;
+	write_src_to_buffer_cache_from_sector(sector, 0, id_first, BLOCK_SECTOR_SIZE, BC_CLASS_INODE);
 
 #ifdef INFO2
 	printf("inode length sectors from parameter: %d\n", sectors);
-	printf("inode_sector_length: %d\n", inode_sector_length(&inode));
+	printf("inode_sector_length: %d\n", id_first_sector_length(id_first));
 #endif
 
-	ASSERT(sectors == (size_t)inode_sector_length(&inode));
+	ASSERT(sectors == (size_t)id_first_sector_length(id_first));
+	free(id_first);
 
   return true;
 }
@@ -290,19 +577,26 @@ inode_create (block_sector_t sector, off_t length){
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  /* Check whether this inode is already open.  One being closed
+     may still have sectors to allocate, and reading it from disk
+     before they are would miss them, so wait for it to go. */
+  key.sector = sector;
+  lock_acquire (&open_inodes_lock);
+  while ((e = hash_find (&open_inodes, &key.elem)) != NULL
+         && hash_entry (e, struct inode, elem)->closing)
+    cond_wait (&open_inodes_changed, &open_inodes_lock);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      while (inode->loading)
+        cond_wait (&open_inodes_changed, &open_inodes_lock);
+      lock_release (&open_inodes_lock);
+      return inode; 
     }
 
 #ifdef INFO12
@@ -315,21 +609,65 @@ inode_open (block_sector_t sector)
 #ifdef INFO12
 	printf("inode_open newly: failed to malloc\n");
 #endif
+    lock_release (&open_inodes_lock);
     return NULL;
 	}
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->loading = true;
+  inode->closing = false;
+  hash_insert (&open_inodes, &inode->elem);
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->companion = 0;
+  inode->ra_next_sector = 0;
+  inode->ra_issued_sector = -1;
+  inode->ra_window = 0;
+  inode->is_dir = false;
+  lock_init (&inode->lock);
+  lock_init (&inode->dir_lock);
+  list_init (&inode->delayed_list);
+  inode->delayed_reserved = 0;
+  inode->delayed_queued = false;
+  inode->meta_dirty = false;
+  lock_release (&open_inodes_lock);
+
+	read_buffer_cache_to_dst_from_sector(sector, 0, &inode->data, BLOCK_SECTOR_SIZE, BC_CLASS_INODE);
+	ASSERT(inode->data.magic==INODE_MAGIC);
+
+  lock_acquire (&open_inodes_lock);
+  inode->loading = false;
+  cond_broadcast (&open_inodes_changed, &open_inodes_lock);
+  lock_release (&open_inodes_lock);
 
+  return inode;
+}
 
-	/* Load to Buffer Cache */
-	struct buffer_cache* bc=get_buffer_cache_value_from_sector(sector);	
-	free(bc);
+/* Marks INODE as holding a directory, which only affects how its
+   sectors are counted in the buffer cache statistics. */
+void
+inode_mark_dir (struct inode *inode)
+{
+  inode->is_dir = true;
+}
 
-  return inode;
+/* Acquires INODE's directory lock, which the directory code holds
+   while it looks up, adds or removes entries, so that none of them
+   sees the entries and index of the directory half changed.  It is
+   separate from INODE's own lock, which is taken by every read and
+   write of the directory file underneath. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases INODE's directory lock. */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
 }
 
 /* Reopens and returns INODE. */
@@ -337,7 +675,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -358,41 +700,81 @@ inode_close (struct inode* inode){
     return;
 
   /* Release resources if this was the last opener. */
+  lock_acquire (&open_inodes_lock);
   if (--inode->open_cnt == 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      bool journaled;
+
+      /* Keep it in the table until it is fully released, so that
+         inode_open() of its sector waits instead of reading the
+         inode before its delayed sectors are allocated. */
+      inode->closing = true;
+      lock_acquire (&delayed_lock);
+      if (inode->delayed_queued)
+        {
+          list_remove (&inode->delayed_elem);
+          inode->delayed_queued = false;
+        }
+      lock_release (&delayed_lock);
+      lock_release (&open_inodes_lock);
+
+      /* Metadata only changes here if delayed sectors get their
+         sectors or a removed inode is freed, so an ordinary close
+         needs no handle. */
+      journaled = inode->removed || !list_empty (&inode->delayed_list);
+      if (journaled)
+        journal_begin ();
+
+      /* Allocate or drop the sectors still waiting for it.  Nobody
+         else can reach INODE any more, but the functions expect it
+         locked. */
+      lock_acquire (&inode->lock);
+      if (inode->removed || !inode_resolve_delayed (inode))
+        inode_discard_delayed (inode);
+      lock_release (&inode->lock);
  
       /* Deallocate blocks if removed. */
       if (inode->removed) 
         {
-					struct buffer_cache* bc = get_buffer_cache_value_from_sector(inode->sector);
-			  	struct inode_disk_first* id_first = (struct inode_disk_first*)(bc->data);
+			  	struct inode_disk_first* id_first = &inode->data;
+					int i;
 
 					ASSERT(id_first->magic==INODE_MAGIC);
 
-					int i = 0, length = inode_sector_length(inode);
-					for (i = 0; i < length; i++) {
-						block_sector_t sector = offset_to_sector(id_first, i);
-						free_map_release(sector, 1);
-					}
-
-					block_sector_t second_t;
-					for (i = 0; i < ID_FIRST_SIZE; i++) {
-						second_t=id_first->id_second_table[i];
-						if(second_t!=0)
-          		free_map_release (second_t, 1);
+					if (!(id_first->flags & INODE_INLINE)) {
+						for (i = 0; i < ID_DIRECT_CNT; i++)
+							if (id_first->direct_table[i] != 0)
+								free_map_release (id_first->direct_table[i], 1);
+						for (i = 0; i < ID_INDIRECT_LEVELS; i++)
+							if (id_first->indirect_table[i] != 0)
+								release_table (id_first->indirect_table[i], i + 1);
 					}
 
           free_map_release (inode->sector, 1);
-					free(bc);
+
+          if (inode->companion != 0)
+            {
+              struct inode *companion = inode_open (inode->companion);
+              if (companion != NULL)
+                {
+                  inode_remove (companion);
+                  inode_close (companion);
+                }
+            }
         }
+      if (journaled)
+        journal_end ();
 #ifdef INFO16
 			printf("inode_close: sector %d\n", inode->sector);
 #endif
+      lock_acquire (&open_inodes_lock);
+      hash_delete (&open_inodes, &inode->elem);
+      cond_broadcast (&open_inodes_changed, &open_inodes_lock);
+      lock_release (&open_inodes_lock);
       free (inode); 
     }
-
+  else
+    lock_release (&open_inodes_lock);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -404,103 +786,429 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Makes the inode at SECTOR, which belongs to INODE, be deleted
+   along with INODE once INODE has been removed and closed by its
+   last opener, replacing any inode set before.  A directory's hash
+   index is such an inode: the directory may be used through other
+   handles after it is removed. */
+void
+inode_set_companion (struct inode *inode, block_sector_t sector)
+{
+  ASSERT (inode != NULL);
+  inode->companion = sector;
+}
+
+/* A position in an array of buffers, for walking a vectored read
+   or write one chunk at a time. */
+struct iov_cursor
+  {
+    const struct iovec *iov;            /* Current buffer. */
+    const struct iovec *end;            /* Just past the last one. */
+    size_t ofs;                         /* Offset in the current buffer. */
+  };
+
+/* Moves C forward N bytes, which must not run past the current
+   buffer, and past any buffers left with nothing in them. */
+static void
+iov_cursor_advance (struct iov_cursor *c, size_t n)
+{
+  c->ofs += n;
+  while (c->iov < c->end && c->ofs >= c->iov->iov_len)
+    {
+      c->iov++;
+      c->ofs = 0;
+    }
+}
+
+/* Points C at the start of the CNT buffers in IOV and returns
+   their total length. */
+static off_t
+iov_cursor_init (struct iov_cursor *c, const struct iovec *iov, int cnt)
+{
+  off_t total = 0;
+  int i;
+
+  for (i = 0; i < cnt; i++)
+    total += iov[i].iov_len;
+  c->iov = iov;
+  c->end = iov + cnt;
+  c->ofs = 0;
+  iov_cursor_advance (c, 0);
+  return total;
+}
+
+/* Returns the bytes left in C's current buffer. */
+static size_t
+iov_cursor_left (const struct iov_cursor *c)
+{
+  return c->iov < c->end ? c->iov->iov_len - c->ofs : 0;
+}
+
+/* Returns where C points. */
+static uint8_t *
+iov_cursor_ptr (const struct iov_cursor *c)
+{
+  return (uint8_t *) c->iov->iov_base + c->ofs;
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
 off_t
-inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
-	uint8_t *buffer = buffer_;
+inode_read_at (struct inode *inode, void *buffer, off_t size, off_t offset)
+{
+  struct iovec iov;
+
+  if (size <= 0)
+    return 0;
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+  return do_readv_at (inode, &iov, 1, offset);
+}
+
+/* Reads into the CNT buffers in IOV, in order, from INODE starting
+   at OFFSET, as if they were one buffer.  Returns the number of
+   bytes actually read, which is short if end of file is reached. */
+off_t
+inode_readv_at (struct inode *inode, const struct iovec *iov, int cnt,
+                off_t offset)
+{
+  return do_readv_at (inode, iov, cnt, offset);
+}
+
+/* Does the work for inode_read_at() and inode_readv_at().  The
+   buffers are filled in one pass over the file's sectors, a chunk
+   at a time, each chunk ending at a sector or buffer boundary,
+   whichever comes first, so that read-ahead sees one sequential
+   read. */
+static off_t
+do_readv_at (struct inode *inode, const struct iovec *iov, int cnt,
+             off_t offset) {
+	struct iov_cursor c;
   off_t bytes_read = 0;
 	off_t offset_sector = 0;
-	struct buffer_cache* bc;
- 	struct inode_disk_first* id_first;
+	off_t init_offset = offset;
+	struct buffer_cache* bc = NULL;
+	off_t size = iov_cursor_init(&c, iov, cnt);
 
 #ifdef INFO3
 	printf("call inode_read_at_2 at sector %d\n", inode->sector);
 #endif
+
+	lock_acquire(&inode->lock);
+	if (inode->data.flags & INODE_INLINE) {
+		while (size > 0 && offset < inode->data.length) {
+			off_t chunk_size = inode->data.length - offset;
+			if ((off_t) iov_cursor_left(&c) < chunk_size)
+				chunk_size = iov_cursor_left(&c);
+			memcpy(iov_cursor_ptr(&c), inode->data.inline_data + offset, chunk_size);
+			iov_cursor_advance(&c, chunk_size);
+			size -= chunk_size;
+			offset += chunk_size;
+			bytes_read += chunk_size;
+		}
+		lock_release(&inode->lock);
+		return bytes_read;
+	}
+	lock_release(&inode->lock);
+
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
 #ifdef INFO
 			printf("%p, offset: %d, size: %d, bytes_read: %d at read\n", inode,  offset, size, bytes_read );
 #endif
-			bc = get_buffer_cache_value_from_sector(inode->sector);
-			id_first = (struct inode_disk_first*)(bc->data);
-			ASSERT(id_first->magic==INODE_MAGIC);
-
+			lock_acquire(&inode->lock);
 			offset_sector = offset / BLOCK_SECTOR_SIZE;
-      int sector_idx = offset_to_sector (id_first, offset_sector);
-			free(bc);
-			if (sector_idx < 0)
-				break;
+      int sector_idx = inode_lookup_sector (inode, offset_sector, &bc);
+      off_t length = inode->data.length;
+			/* A virtual sector is renamed once it is allocated, so it
+				 has to be read before the lock is dropped. */
+			if (sector_idx < 0 || !is_virtual_sector(sector_idx))
+				lock_release(&inode->lock);
 
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      off_t inode_left = length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
-      /* Number of bytes to actually copy out of this sector. */
+      /* Number of bytes to actually copy out of this sector into
+         the current buffer. */
       int chunk_size = size < min_left ? size : min_left;
+      if ((off_t) iov_cursor_left (&c) < chunk_size)
+        chunk_size = iov_cursor_left (&c);
 #ifdef INFO
 			printf("chunk_size %d, sector_idx %d, inode_length %d\n", chunk_size, sector_idx, inode_length(inode));
 #endif
       if (chunk_size <= 0)
-        break;
+        {
+          if (sector_idx >= 0 && is_virtual_sector(sector_idx))
+            lock_release(&inode->lock);
+          break;
+        }
 
-			bc = get_buffer_cache_value_from_sector(sector_idx);
 #ifdef INFO
-			printf("bc selected when read inode at sector_idx %d\n", sector_idx);
+			printf("read inode at sector_idx %d\n", sector_idx);
 #endif
+			/* A sector that was never written is a hole and reads as
+				 zeros. */
+			if (sector_idx < 0)
+				memset(iov_cursor_ptr(&c), 0, chunk_size);
+			else
+				read_buffer_cache_to_dst_from_sector(sector_idx, sector_ofs, iov_cursor_ptr(&c), chunk_size, inode_data_class(inode));
+			if (sector_idx >= 0 && is_virtual_sector(sector_idx))
+				lock_release(&inode->lock);
 
-     if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-					memcpy(buffer + bytes_read, bc->data, BLOCK_SECTOR_SIZE);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          memcpy (buffer + bytes_read, bc->data + sector_ofs, chunk_size);
-        }
-     	free(bc); 
       /* Advance. */
+      iov_cursor_advance (&c, chunk_size);
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
+	if (bc != NULL)
+		unpin_buffer_cache(bc);
 
 #ifdef INFO
 	printf("inode_read at is finished\n");
 #endif
 
+	if (bytes_read > 0)
+		inode_read_ahead (inode, init_offset, offset);
+
   return bytes_read;
 }
 
+/* Called after INODE was read from START up to END.  If the read
+   picked up where the previous one left off, grows the read-ahead
+   window and queues the sectors following END that have not been
+   queued yet; otherwise the access is treated as random and the
+   window collapses. */
+static void
+inode_read_ahead (struct inode *inode, off_t start, off_t end)
+{
+	off_t first = start / BLOCK_SECTOR_SIZE;
+	off_t last = (end - 1) / BLOCK_SECTOR_SIZE;
+	int max_window = READ_AHEAD_MAX_WINDOW < BUFFER_CACHE_READ_AHEAD_MAX
+									 ? READ_AHEAD_MAX_WINDOW : BUFFER_CACHE_READ_AHEAD_MAX;
+	off_t from, to, length_sectors, i;
+	struct buffer_cache* bc = NULL;
+
+	if (first == inode->ra_next_sector) {
+		inode->ra_window = inode->ra_window == 0 ? READ_AHEAD_MIN_WINDOW : inode->ra_window * 2;
+		if (inode->ra_window > max_window)
+			inode->ra_window = max_window;
+	}
+	else {
+		inode->ra_window = 0;
+		inode->ra_issued_sector = last;
+	}
+	inode->ra_next_sector = end / BLOCK_SECTOR_SIZE;
+
+	if (inode->ra_window == 0)
+		return;
+
+	length_sectors = bytes_to_sectors (inode_length (inode));
+	from = inode->ra_issued_sector + 1 > last + 1 ? inode->ra_issued_sector + 1 : last + 1;
+	to = last + inode->ra_window < length_sectors - 1 ? last + inode->ra_window : length_sectors - 1;
+	if (from > to)
+		return;
+
+	lock_acquire(&inode->lock);
+	for (i = from; i <= to; i++) {
+		int sector_idx = offset_to_sector_pinned (&inode->data, i, &bc);
+		if (sector_idx > 0)
+			request_read_ahead_buffer_cache (sector_idx);
+	}
+	lock_release(&inode->lock);
+	if (bc != NULL)
+		unpin_buffer_cache(bc);
+
+	inode->ra_issued_sector = i - 1;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
    (Normally a write at end of file would extend the inode, but
    growth is not yet implemented.) */
 off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
-                off_t offset) {
-  const uint8_t *buffer = buffer_;
+inode_write_at (struct inode *inode, const void *buffer, off_t size,
+                off_t offset)
+{
+  struct iovec iov;
+  off_t bytes_written;
+
+  if (size <= 0)
+    return 0;
+  iov.iov_base = (void *) buffer;
+  iov.iov_len = size;
+  journal_begin ();
+  bytes_written = do_writev_at (inode, &iov, 1, offset);
+  journal_end ();
+  return bytes_written;
+}
+
+/* Writes the CNT buffers in IOV, in order, to INODE starting at
+   OFFSET, as if they were one buffer.  The whole write is one
+   journal handle.  Returns the number of bytes actually written. */
+off_t
+inode_writev_at (struct inode *inode, const struct iovec *iov, int cnt,
+                 off_t offset)
+{
+  off_t bytes_written;
+
+  journal_begin ();
+  bytes_written = do_writev_at (inode, iov, cnt, offset);
+  journal_end ();
+  return bytes_written;
+}
+
+/* Copies SIZE bytes of SRC starting at SRC_OFS to DST starting at
+   DST_OFS, as reading them and writing them back would, but
+   straight from SRC's cache slots into DST's.  Each source slot is
+   pinned, not locked, while its bytes are written, so that copies
+   in opposite directions cannot deadlock; a copy that races a
+   write to SRC may see part of it, as a read could.  Holes copy as
+   zeros.  Returns the number of bytes copied, which is short if
+   the end of SRC is reached or DST cannot grow, or -1 if SRC and
+   DST are the same inode and the ranges overlap. */
+off_t
+inode_copy_at (struct inode *dst, off_t dst_ofs, struct inode *src,
+               off_t src_ofs, off_t size)
+{
+  static const uint8_t zeros[BLOCK_SECTOR_SIZE];
+  struct buffer_cache *table = NULL;
+  off_t copied = 0;
+
+  if (src == dst && src_ofs < dst_ofs + size && dst_ofs < src_ofs + size)
+    return -1;
+
+  while (size > 0)
+    {
+      struct buffer_cache *bc = NULL;
+      uint8_t *inline_copy = NULL;
+      const uint8_t *from;
+      int sector_idx, sector_ofs = src_ofs % BLOCK_SECTOR_SIZE;
+      off_t chunk = BLOCK_SECTOR_SIZE - sector_ofs, written;
+      bool is_inline;
+
+      /* Pin the source sector, or copy the little there is of an
+         inline file, while the block map cannot change. */
+      lock_acquire (&src->lock);
+      if (chunk > size)
+        chunk = size;
+      if (chunk > src->data.length - src_ofs)
+        chunk = src->data.length - src_ofs;
+      is_inline = src->data.flags & INODE_INLINE;
+      if (chunk <= 0)
+        from = NULL;
+      else if (is_inline)
+        {
+          inline_copy = malloc (chunk);
+          if (inline_copy != NULL)
+            memcpy (inline_copy, src->data.inline_data + src_ofs, chunk);
+          from = inline_copy;
+        }
+      else
+        {
+          sector_idx = inode_lookup_sector (src, src_ofs / BLOCK_SECTOR_SIZE, &table);
+          if (sector_idx < 0)
+            from = zeros;
+          else
+            {
+              bc = pin_buffer_cache_from_sector (sector_idx, inode_data_class (src));
+              from = (const uint8_t *) bc->data + sector_ofs;
+            }
+        }
+      lock_release (&src->lock);
+      if (from == NULL)
+        break;
+
+      written = inode_write_at (dst, from, chunk, dst_ofs);
+      if (bc != NULL)
+        unpin_buffer_cache (bc);
+      free (inline_copy);
+      if (!is_inline && written > 0)
+        inode_read_ahead (src, src_ofs, src_ofs + written);
+
+      copied += written;
+      src_ofs += written;
+      dst_ofs += written;
+      size -= written;
+      if (written < chunk)
+        break;
+    }
+  if (table != NULL)
+    unpin_buffer_cache (table);
+
+  return copied;
+}
+
+/* Does the work for inode_write_at() and inode_writev_at(), inside
+   a journal handle so that the sectors allocated and the new length
+   are committed together.  Like do_readv_at(), it makes one pass
+   over the sectors, a chunk at a time. */
+static off_t
+do_writev_at (struct inode *inode, const struct iovec *iov, int cnt,
+              off_t offset) {
+	struct iov_cursor c;
   off_t bytes_written = 0;
 	off_t offset_sector = 0;
 	off_t init_offset = offset;
+	struct buffer_cache* bc = NULL;
+	off_t size = iov_cursor_init(&c, iov, cnt);
 
   if (inode->deny_write_cnt)
     return 0;
 
+	lock_acquire(&inode->lock);
+
+	if (inode->data.flags & INODE_INLINE) {
+		if (size <= 0) {
+			lock_release(&inode->lock);
+			return 0;
+		}
+		if (offset + size <= INODE_INLINE_MAX) {
+			while (bytes_written < size) {
+				off_t chunk_size = iov_cursor_left(&c);
+				memcpy(inode->data.inline_data + offset + bytes_written,
+							 iov_cursor_ptr(&c), chunk_size);
+				write_src_to_buffer_cache_from_sector(inode->sector,
+						offsetof (struct inode_disk_first, inline_data) + offset + bytes_written,
+						iov_cursor_ptr(&c), chunk_size, BC_CLASS_INODE);
+				iov_cursor_advance(&c, chunk_size);
+				bytes_written += chunk_size;
+			}
+			inode->meta_dirty = true;
+			if (inode->data.length < offset + size)
+				inode_set_byte_length_2(inode, offset + size);
+			lock_release(&inode->lock);
+			return size;
+		}
+		if (!inode_migrate_inline(inode)) {
+			lock_release(&inode->lock);
+			return 0;
+		}
+	}
+
   while (size > 0) 
     {
-      /* Sector to write, starting byte offset within sector. */
+      /* Sector to write, starting byte offset within sector.  A
+         missing sector is only allocated when it is written back,
+         unless too many are waiting already.  Sectors the write
+         skips over stay holes. */
 			offset_sector = offset / BLOCK_SECTOR_SIZE;
-      int sector_idx = offset_to_sector_with_expand (inode->sector, offset_sector);
+      int sector_idx = inode_lookup_sector (inode, offset_sector, &bc);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
+			if (sector_idx == -1)
+				sector_idx = inode_delay_sector (inode, offset_sector);
+			if (sector_idx == -1) {
+				sector_idx = offset_to_sector_with_expand (&inode->data, inode->sector, offset_sector);
+				inode->meta_dirty = true;
+			}
 			if (sector_idx==-1)
 				break;
 
@@ -510,8 +1218,11 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 //      int min_left = inode_left < sector_left ? inode_left : sector_left;
 			int min_left = BLOCK_SECTOR_SIZE - sector_ofs;
 
-      /* Number of bytes to actually write into this sector. */
+      /* Number of bytes to actually write into this sector from
+         the current buffer. */
       int chunk_size = size < min_left ? size : min_left;
+      if ((off_t) iov_cursor_left (&c) < chunk_size)
+        chunk_size = iov_cursor_left (&c);
 
 #ifdef INFO6
 //			printf("inode_write_at_2: inode %x, buffer %x, size %d, offset %d, offset_sector %d, sector_idx %d, sector_ofs %d, inode_left %d, sector_left %d, min_left %d, chunk_size %d\n", inode, buffer, size, offset, offset_sector, sector_idx, sector_ofs, inode_left, sector_left, min_left, chunk_size);
@@ -528,28 +1239,347 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
           /* Write full sector directly to disk. */
-					write_src_to_buffer_cache_from_sector(sector_idx, 0, buffer+bytes_written, BLOCK_SECTOR_SIZE);
+					write_src_to_owned_buffer_cache_from_sector(sector_idx, 0, iov_cursor_ptr(&c), BLOCK_SECTOR_SIZE, inode_data_class(inode), inode->sector);
        }
       else 
         {
-					write_src_to_buffer_cache_from_sector(sector_idx, sector_ofs, buffer+bytes_written, chunk_size);
+					write_src_to_owned_buffer_cache_from_sector(sector_idx, sector_ofs, iov_cursor_ptr(&c), chunk_size, inode_data_class(inode), inode->sector);
         }
 
       /* Advance. */
+      iov_cursor_advance (&c, chunk_size);
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
+	if (bc != NULL)
+		unpin_buffer_cache(bc);
 
-
-	if (inode_length(inode) < init_offset + bytes_written)
+	if (inode->data.length < init_offset + bytes_written)
 		inode_set_byte_length_2(inode, init_offset+bytes_written);
-
+	lock_release(&inode->lock);
 
   return bytes_written;
 }
 
 
+/* Moves the inline data of INODE, which must be locked, into a
+   data sector of its own so that the file can grow past the inode.
+   Returns false, leaving INODE as it was, if the disk is full. */
+static bool
+inode_migrate_inline (struct inode *inode)
+{
+	struct inode_disk_first* id_first = &inode->data;
+	off_t length = id_first->length;
+	uint8_t* data;
+	int sector;
+
+	ASSERT(id_first->flags & INODE_INLINE);
+
+	data = malloc(INODE_INLINE_MAX);
+	if (data == NULL)
+		return false;
+	memcpy(data, id_first->inline_data, INODE_INLINE_MAX);
+
+	inode->meta_dirty = true;
+	id_first->flags &= ~INODE_INLINE;
+	id_first->length = 0;
+	memset(id_first->inline_data, 0, INODE_INLINE_MAX);
+	write_src_to_buffer_cache_from_sector(inode->sector, 0, id_first, BLOCK_SECTOR_SIZE, BC_CLASS_INODE);
+
+	if (length > 0) {
+		sector = offset_to_sector_with_expand(id_first, inode->sector, 0);
+		if (sector == -1) {
+			id_first->flags |= INODE_INLINE;
+			id_first->length = length;
+			memcpy(id_first->inline_data, data, INODE_INLINE_MAX);
+			write_src_to_buffer_cache_from_sector(inode->sector, 0, id_first, BLOCK_SECTOR_SIZE, BC_CLASS_INODE);
+			free(data);
+			return false;
+		}
+		write_src_to_owned_buffer_cache_from_sector(sector, 0, data, length, inode_data_class(inode), inode->sector);
+		inode_set_byte_length_2(inode, length);
+	}
+
+	free(data);
+	return true;
+}
+
+/* Orders delayed sectors by file offset. */
+static bool
+delayed_sector_less (const struct list_elem *a_, const struct list_elem *b_,
+                     void *aux UNUSED)
+{
+  const struct delayed_sector *a = list_entry (a_, struct delayed_sector, elem);
+  const struct delayed_sector *b = list_entry (b_, struct delayed_sector, elem);
+
+  return a->offset < b->offset;
+}
+
+/* Returns the sector that holds sector OFFSET of INODE, which must
+   be locked: the virtual sector of data whose allocation has been
+   put off, or else what offset_to_sector_pinned() finds, which
+   may leave *BC pinned.  Returns -1 for a hole. */
+static int
+inode_lookup_sector (struct inode *inode, off_t offset, struct buffer_cache **bc)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&inode->delayed_list); e != list_end (&inode->delayed_list);
+       e = list_next (e))
+    {
+      struct delayed_sector *d = list_entry (e, struct delayed_sector, elem);
+      if (d->offset == offset)
+        return d->sector;
+      if (d->offset > offset)
+        break;
+    }
+  return offset_to_sector_pinned (&inode->data, offset, bc);
+}
+
+/* Puts off allocating sector OFFSET of INODE, which must be locked
+   and must not have the sector yet.  Reserves room for the sector
+   and for the worst case of the indirect blocks it may need, one
+   per level of its path, and returns a new, zeroed
+   virtual sector to write the data into.  Returns -1 if the
+   sector has to be allocated right away instead: too many are
+   waiting, the disk is nearly full or INODE is the free map. */
+static int
+inode_delay_sector (struct inode *inode, off_t offset)
+{
+  int idx[ID_INDIRECT_LEVELS], level = offset_to_path (offset, idx);
+  struct delayed_sector *d;
+
+  if (level < 0 || inode->sector == FREE_MAP_SECTOR)
+    return -1;
+
+  lock_acquire (&delayed_lock);
+  if (delayed_cnt >= INODE_DELAYED_MAX)
+    {
+      lock_release (&delayed_lock);
+      wake_dirty_buffer_cache_writer ();
+      return -1;
+    }
+  delayed_cnt++;
+  lock_release (&delayed_lock);
+
+  d = malloc (sizeof *d);
+  if (d == NULL || !free_map_reserve (1 + level))
+    {
+      free (d);
+      lock_acquire (&delayed_lock);
+      delayed_cnt--;
+      lock_release (&delayed_lock);
+      return -1;
+    }
+  d->offset = offset;
+  d->sector = new_virtual_buffer_cache_sector ();
+  unpin_buffer_cache (pin_new_buffer_cache_from_sector (d->sector, inode_data_class (inode)));
+
+  lock_acquire (&delayed_lock);
+  if (!inode->delayed_queued)
+    {
+      list_push_back (&delayed_inodes, &inode->delayed_elem);
+      inode->delayed_queued = true;
+    }
+  lock_release (&delayed_lock);
+  list_insert_ordered (&inode->delayed_list, &d->elem, delayed_sector_less, NULL);
+  inode->delayed_reserved += 1 + level;
+  return d->sector;
+}
+
+/* Allocates sectors for the delayed data of INODE, which must be
+   locked, one run per stretch of consecutive offsets, and moves
+   the cached data over to them.  INODE may stay on delayed_inodes
+   with nothing left to allocate.
+
+   The reservation made by inode_delay_sector() covers every sector
+   this can need, so it should not run out of space.  If it does
+   anyway, the sectors not allocated yet stay delayed, along with
+   the whole reservation, and false is returned. */
+static bool
+inode_resolve_delayed (struct inode *inode)
+{
+  struct buffer_cache *bc = NULL;
+  struct delayed_sector *d;
+  struct list_elem *e;
+  block_sector_t hint, run;
+  size_t cnt, got, k;
+  int prev, resolved = 0;
+  bool success = true;
+
+  if (list_empty (&inode->delayed_list))
+    return true;
+
+  while (success && !list_empty (&inode->delayed_list))
+    {
+      d = list_entry (list_front (&inode->delayed_list), struct delayed_sector, elem);
+      hint = inode->sector + 1;
+      if (d->offset > 0
+          && (prev = offset_to_sector_pinned (&inode->data, d->offset - 1, &bc)) != -1)
+        hint = prev + 1;
+
+      cnt = 1;
+      for (e = list_next (&d->elem); e != list_end (&inode->delayed_list); e = list_next (e))
+        {
+          if (list_entry (e, struct delayed_sector, elem)->offset != d->offset + (off_t) cnt)
+            break;
+          cnt++;
+        }
+
+      got = free_map_allocate_run (hint, cnt, &run, true);
+      if (got == 0)
+        {
+          success = false;
+          break;
+        }
+      for (k = 0; k < got; k++)
+        {
+          /* Map the sector before moving the data there, so that a
+             failure leaves D delayed as it was. */
+          d = list_entry (list_front (&inode->delayed_list), struct delayed_sector, elem);
+          if (offset_to_sector_with_expand_second (&inode->data, inode->sector, d->offset,
+                                                   run + k, &bc, true) == -1)
+            {
+              free_map_release (run + k, got - k);
+              success = false;
+              break;
+            }
+          rename_buffer_cache (d->sector, run + k);
+          list_pop_front (&inode->delayed_list);
+          free (d);
+          resolved++;
+        }
+    }
+  if (bc != NULL)
+    unpin_buffer_cache (bc);
+
+  if (resolved > 0)
+    inode->meta_dirty = true;
+  if (success)
+    {
+      free_map_unreserve (inode->delayed_reserved);
+      inode->delayed_reserved = 0;
+    }
+  else
+    printf ("inode %u: no space for delayed sectors, %d left in cache\n",
+            (unsigned) inode->sector, (int) list_size (&inode->delayed_list));
+  lock_acquire (&delayed_lock);
+  delayed_cnt -= resolved;
+  lock_release (&delayed_lock);
+  return success;
+}
+
+/* Throws away the delayed data of INODE, which has been removed
+   and is being closed for the last time. */
+static void
+inode_discard_delayed (struct inode *inode)
+{
+  struct delayed_sector *d;
+  int discarded = 0;
+
+  while (!list_empty (&inode->delayed_list))
+    {
+      d = list_entry (list_pop_front (&inode->delayed_list), struct delayed_sector, elem);
+      discard_buffer_cache (d->sector);
+      free (d);
+      discarded++;
+    }
+
+  free_map_unreserve (inode->delayed_reserved);
+  inode->delayed_reserved = 0;
+  lock_acquire (&delayed_lock);
+  delayed_cnt -= discarded;
+  lock_release (&delayed_lock);
+}
+
+/* Allocates the sectors of all delayed data, so that the dirty
+   writer can write it back.  Called by the writer before each
+   pass.  An inode whose sectors could not all be allocated is
+   queued again for the next pass. */
+void
+inode_flush_delayed (void)
+{
+  struct list retry;
+  struct inode *inode;
+  bool success;
+
+  list_init (&retry);
+  for (;;)
+    {
+      lock_acquire (&open_inodes_lock);
+      lock_acquire (&delayed_lock);
+      if (list_empty (&delayed_inodes))
+        {
+          while (!list_empty (&retry))
+            list_push_back (&delayed_inodes, list_pop_front (&retry));
+          lock_release (&delayed_lock);
+          lock_release (&open_inodes_lock);
+          break;
+        }
+      inode = list_entry (list_pop_front (&delayed_inodes), struct inode, delayed_elem);
+      inode->delayed_queued = false;
+      inode->open_cnt++;
+      lock_release (&delayed_lock);
+      lock_release (&open_inodes_lock);
+
+      journal_begin ();
+      lock_acquire (&inode->lock);
+      success = inode_resolve_delayed (inode);
+      lock_release (&inode->lock);
+      if (!success)
+        {
+          /* inode_close() takes it off RETRY if it is the last
+             close, just as it would off delayed_inodes. */
+          lock_acquire (&delayed_lock);
+          if (!inode->delayed_queued)
+            {
+              list_push_back (&retry, &inode->delayed_elem);
+              inode->delayed_queued = true;
+            }
+          lock_release (&delayed_lock);
+        }
+      inode_close (inode);
+      journal_end ();
+    }
+}
+
+/* Writes INODE's data to disk and commits its metadata.  If
+   DATA_ONLY, the metadata is only committed when the data could not
+   be read back without it: sectors were allocated or the length
+   changed since INODE was last synced.  Only INODE's own data slots
+   are written.  A commit takes along all the metadata changed so
+   far, as the journal has only one transaction, but of other files'
+   data it writes only what sits in sectors that metadata allocated
+   (see journal_commit()), not everything a full writer pass would.
+   Without a journal there is nothing to commit, and the metadata
+   goes out with a full pass.
+   Returns false if INODE's delayed data could not be given sectors,
+   in which case that data is still only in the cache. */
+bool
+inode_sync (struct inode *inode, bool data_only)
+{
+  bool meta_dirty, success;
+
+  journal_begin ();
+  lock_acquire (&inode->lock);
+  success = inode_resolve_delayed (inode);
+  meta_dirty = inode->meta_dirty;
+  inode->meta_dirty = false;
+  lock_release (&inode->lock);
+  journal_end ();
+
+  write_owned_buffer_cache_to_sector (inode->sector);
+  if (meta_dirty || !data_only)
+    {
+      if (journal_active ())
+        journal_commit ();
+      else
+        write_dirty_buffer_cache_to_sector ();
+    }
+  return success;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
@@ -570,79 +1600,55 @@ inode_allow_write (struct inode *inode)
   inode->deny_write_cnt--;
 }
 
-/* Returns the length, in bytes, of INODE's data. */
+/* Returns the length, in bytes, of INODE's data.  The length is
+   a single aligned word that only grows under INODE's lock, so it
+   can be read without taking the lock. */
 off_t
 inode_length (const struct inode *inode){
-	struct buffer_cache* bc = get_buffer_cache_value_from_sector(inode->sector);	
-	struct inode_disk_first* id = (struct inode_disk_first*)(bc->data);
-	ASSERT(id->magic==INODE_MAGIC);
-	off_t ret = id->length;
-
-	free(bc);
-
-	return ret;
+	ASSERT(inode->data.magic==INODE_MAGIC);
+	return inode->data.length;
 }
 
+/* Sets INODE's length to LENGTH and writes it through to the
+   cache.  The caller must hold INODE's lock. */
 void
-inode_set_byte_length_2(const struct inode *inode, off_t length)
+inode_set_byte_length_2(struct inode *inode, off_t length)
 {
-	struct buffer_cache* bc = get_buffer_cache_value_from_sector(inode->sector);	
-	struct inode_disk_first* id = (struct inode_disk_first*)(bc->data);
-	ASSERT(id->magic==INODE_MAGIC);
-	id->length = length;
-
-	write_src_to_buffer_cache_from_sector(inode->sector, 0, id, BLOCK_SECTOR_SIZE);
-
-	free(bc);
+	ASSERT(lock_held_by_current_thread(&inode->lock));
+	inode->data.length = length;
+	inode->meta_dirty = true;
+	write_src_to_buffer_cache_from_sector(inode->sector,
+			offsetof (struct inode_disk_first, length),
+			&length, sizeof length, BC_CLASS_INODE);
 }
 
+/* Returns the number of data sectors allocated to INODE. */
 off_t
 inode_sector_length(const struct inode* inode){
-	int i=0, j=0;
-	off_t length=0;
- 	struct buffer_cache* bc;
-	struct inode_disk_first* id_first;
-	struct inode_disk_second* id_second;
-
 #ifdef INFO2
 	printf("inode sector at inode_length: %d\n", inode->sector);
 #endif
+	return id_first_sector_length(&inode->data);
+}
 
-	bc = get_buffer_cache_value_from_sector(inode->sector);	
-	id_first = (struct inode_disk_first*)(bc->data);
+/* Returns the number of data sectors allocated to the file whose
+   inode is ID_FIRST. */
+static off_t
+id_first_sector_length(const struct inode_disk_first* id_first){
+	off_t length=0;
+	int i;
 
 	ASSERT(id_first->magic==INODE_MAGIC);
- 
-	for(i=0; i<ID_FIRST_SIZE; i++){
-		if (id_first->id_second_table[i] == 0){
-			free(bc);
-			return length;
-		}
-
-		block_sector_t id_second_sector = id_first->id_second_table[i];
-		struct buffer_cache* bc2 = get_buffer_cache_value_from_sector(id_second_sector);	
-		id_second = (struct inode_disk_second*)(bc2->data);
 
-		for(j=0; j<ID_SECOND_SIZE; j++){
-#ifdef INFO2
-		printf("id_first idx at inode_length: %d, its second sector: %d\n", i, id_first->id_second_table[i]);
-		printf("id_second idx at inode_length: %d, its data sector: %d\n", j, id_second->data_table[j]);
-#endif
-			if (id_second->data_table[j]!=0)
-				length++;
-			else{
-				free(bc);
-				free(bc2);
-				return length;
-			}
-		}
-
-		free(bc2);		
-	}
+	if (id_first->flags & INODE_INLINE)
+		return 0;
+	for (i = 0; i < ID_DIRECT_CNT; i++)
+		if (id_first->direct_table[i] != 0)
+			length++;
+	for (i = 0; i < ID_INDIRECT_LEVELS; i++)
+		if (id_first->indirect_table[i] != 0)
+			length += table_sector_length(id_first->indirect_table[i], i + 1);
 
-	// max block size 504 * 512
-	ASSERT (length == 258048);
-	free(bc); 
 	return length;
 }
 
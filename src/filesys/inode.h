@@ -2,6 +2,7 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <iovec.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
@@ -9,10 +10,8 @@ struct bitmap;
 
 struct inode_disk_first* new_inode_disk_first(off_t);
 struct inode_disk_second* new_inode_disk_second(void);
-char* new_zeros_sector(void);
 void test_zero_sector_size(void);
-int offset_to_sector_with_expand(block_sector_t, off_t);
-int offset_to_sector_with_expand_second(block_sector_t, off_t*);
+int offset_to_sector_with_expand(struct inode_disk_first*, block_sector_t, off_t);
 int offset_to_sector(struct inode_disk_first*, off_t);
 
 
@@ -20,15 +19,25 @@ void inode_init (void);
 bool inode_create (block_sector_t, off_t);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
+void inode_mark_dir (struct inode *);
+void inode_lock_dir (struct inode *);
+void inode_unlock_dir (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_set_companion (struct inode *, block_sector_t);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_readv_at (struct inode *, const struct iovec *, int cnt, off_t offset);
+off_t inode_writev_at (struct inode *, const struct iovec *, int cnt, off_t offset);
+off_t inode_copy_at (struct inode *dst, off_t dst_ofs, struct inode *src,
+                     off_t src_ofs, off_t size);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
-void inode_set_byte_length_2(const struct inode *, off_t length);
+void inode_set_byte_length_2(struct inode *, off_t length);
 off_t inode_sector_length(const struct inode *);
 block_sector_t inode_to_sector(struct inode*);
+void inode_flush_delayed (void);
+bool inode_sync (struct inode *, bool data_only);
 #endif /* filesys/inode.h */
@@ -0,0 +1,375 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata journal.
+
+   Every change to inodes, indirect blocks, directories and the
+   free map is made inside a handle, between journal_begin() and
+   journal_end(), and leaves the sectors it dirtied marked in the
+   buffer cache as part of the running transaction.  The cache
+   does not write those sectors back on its own.  Instead the dirty
+   writer calls journal_commit() after each pass, which waits for
+   the handles in progress to end, so that the metadata is in a
+   consistent state, and then:
+
+     0. frees the sectors released in the transaction, which stay
+        unusable until now, and writes the data still dirty in
+        sectors the transaction allocated, so that no committed
+        metadata points at sectors that do not hold what it says
+        they do,
+     1. writes a descriptor listing the home sectors of the
+        changed metadata to JOURNAL_SECTOR + 1,
+     2. writes full copies of those sectors after it,
+     3. writes a commit record with a checksum of the above,
+     4. writes the sectors to their homes, and
+     5. bumps the sequence number in the header at JOURNAL_SECTOR,
+        which retires the transaction.
+
+   If the machine stops after step 3 but before step 5,
+   journal_init() finds a descriptor and a commit record that
+   match the header and copies the logged sectors home again.
+   Anything that stopped earlier never happened.
+
+   File data is not logged.  A transaction holds at most
+   JOURNAL_BLOCKS_MAX sectors.  The cache wakes the writer once it
+   is half that size, and a handle that would start on a
+   transaction of JOURNAL_FORCE_CNT sectors commits it first.  Only
+   handles running at that moment can take it past the limit, in
+   which case it is committed in several pieces, each atomic by
+   itself.  A metadata sector the cache has to evict before its
+   commit goes straight home. */
+
+/* Size of the running transaction at which journal_begin() commits
+   it before starting a handle.  The rest of JOURNAL_BLOCKS_MAX is
+   left for the handles already open. */
+#define JOURNAL_FORCE_CNT (JOURNAL_BLOCKS_MAX * 3 / 4)
+
+#define JOURNAL_MAGIC 0x4a524e4c        /* Header. */
+#define JOURNAL_DESC_MAGIC 0x4a444553   /* Descriptor. */
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54 /* Commit record. */
+
+/* At JOURNAL_SECTOR. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    uint32_t seq;                       /* Sequence number of next commit. */
+    uint32_t unused[126];               /* Not used. */
+  };
+
+/* At JOURNAL_SECTOR + 1, followed by CNT logged sectors. */
+struct journal_descriptor
+  {
+    uint32_t magic;                     /* JOURNAL_DESC_MAGIC. */
+    uint32_t seq;                       /* Sequence number of commit. */
+    uint32_t cnt;                       /* Number of sectors logged. */
+    block_sector_t sectors[JOURNAL_BLOCKS_MAX]; /* Their home sectors. */
+  };
+
+/* Right after the last logged sector. */
+struct journal_commit_record
+  {
+    uint32_t magic;                     /* JOURNAL_COMMIT_MAGIC. */
+    uint32_t seq;                       /* Same as descriptor's. */
+    uint32_t cnt;                       /* Same as descriptor's. */
+    uint32_t checksum;                  /* Of descriptor and sectors. */
+    uint32_t unused[124];               /* Not used. */
+  };
+
+/* Set once the journal has been recovered or created.  Before
+   that, the cache treats metadata like any other data. */
+static bool journal_enabled;
+
+/* Protects the fields below. */
+static struct lock journal_lock;
+
+/* Broadcast when journal_handles drops to 0 and when a commit
+   ends. */
+static struct condition journal_changed;
+
+static int journal_handles;             /* Threads inside a handle. */
+static bool journal_committing;         /* A commit is running. */
+static uint32_t journal_seq;            /* Next sequence number. */
+
+/* Sector buffers.  Only the committing thread uses them. */
+static struct journal_header journal_header;
+static struct journal_descriptor journal_descriptor;
+static struct journal_commit_record journal_commit_record;
+
+static bool journal_replay (void);
+static void journal_write_header (void);
+static void journal_write_batch (struct buffer_cache **, int);
+static uint32_t journal_checksum (uint32_t, const void *);
+
+/* Recovers the journal, or creates an empty one if FORMAT is true.
+   Must be called before anything else touches the file system. */
+void
+journal_init (bool format)
+{
+  ASSERT (sizeof (struct journal_header) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct journal_descriptor) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct journal_commit_record) == BLOCK_SECTOR_SIZE);
+
+  lock_init (&journal_lock);
+  cond_init (&journal_changed);
+
+  if (format)
+    {
+      /* Keep counting from the old journal, if there was one, so
+         that no stale commit record can match, and wipe its
+         descriptor. */
+      block_read (fs_device, JOURNAL_SECTOR, &journal_header);
+      journal_seq = journal_header.magic == JOURNAL_MAGIC
+                    ? journal_header.seq + 1 : 0;
+      memset (&journal_descriptor, 0, sizeof journal_descriptor);
+      block_write (fs_device, JOURNAL_SECTOR + 1, &journal_descriptor);
+      journal_write_header ();
+      journal_enabled = true;
+    }
+  else
+    journal_enabled = journal_replay ();
+}
+
+/* Returns true if metadata changes are being journaled. */
+bool
+journal_active (void)
+{
+  return journal_enabled;
+}
+
+/* Starts a handle.  The metadata changes made until the matching
+   journal_end() are committed together.  Handles nest; only the
+   outermost one waits for a commit in progress to finish, and
+   commits the running transaction itself if it is nearly full. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+  bool committed = false;
+
+  if (t->journal_depth > 0)
+    {
+      t->journal_depth++;
+      return;
+    }
+
+  for (;;)
+    {
+      lock_acquire (&journal_lock);
+      while (journal_committing)
+        cond_wait (&journal_changed, &journal_lock);
+      if (!journal_enabled || committed
+          || count_journal_buffer_cache () < JOURNAL_FORCE_CNT)
+        break;
+      lock_release (&journal_lock);
+      journal_commit ();
+      committed = true;
+    }
+  journal_handles++;
+  t->journal_depth++;
+  lock_release (&journal_lock);
+}
+
+/* Ends a handle started by journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  if (--journal_handles == 0)
+    cond_broadcast (&journal_changed, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Commits the metadata changed since the last commit, writes it
+   to its home sectors and retires it from the journal.  Must not
+   be called inside a handle, which it would wait for forever. */
+void
+journal_commit (void)
+{
+  struct buffer_cache **slots;
+  int cnt;
+
+  ASSERT (thread_current ()->journal_depth == 0);
+
+  if (!journal_enabled)
+    return;
+
+  slots = malloc (sizeof *slots * JOURNAL_BLOCKS_MAX);
+  if (slots == NULL)
+    return;
+
+  lock_acquire (&journal_lock);
+  while (journal_committing)
+    cond_wait (&journal_changed, &journal_lock);
+  journal_committing = true;
+  while (journal_handles > 0)
+    cond_wait (&journal_changed, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* No handle is open and none can start.  Free what the
+     transaction released and write the data it allocated sectors
+     for.  Freeing writes the free map through calls that begin
+     handles of their own, which must not wait for this commit, so
+     it runs as if inside a handle of this thread. */
+  thread_current ()->journal_depth = 1;
+  free_map_commit ();
+  write_fresh_buffer_cache_to_sector ();
+  thread_current ()->journal_depth = 0;
+
+  /* Nobody modifies the pinned slots while they are written
+     straight from the cache. */
+  while ((cnt = collect_journal_buffer_cache (slots, JOURNAL_BLOCKS_MAX)) > 0)
+    {
+      journal_write_batch (slots, cnt);
+      release_journal_buffer_cache (slots, cnt);
+    }
+
+  lock_acquire (&journal_lock);
+  journal_committing = false;
+  cond_broadcast (&journal_changed, &journal_lock);
+  lock_release (&journal_lock);
+
+  free (slots);
+}
+
+/* Logs the CNT pinned slots in SLOTS, sorted by sector, as one
+   transaction, then writes them home and retires it. */
+static void
+journal_write_batch (struct buffer_cache **slots, int cnt)
+{
+  struct journal_descriptor *d = &journal_descriptor;
+  struct journal_commit_record *c = &journal_commit_record;
+  uint32_t checksum;
+  int i;
+
+  ASSERT (cnt > 0 && cnt <= JOURNAL_BLOCKS_MAX);
+
+  memset (d, 0, sizeof *d);
+  d->magic = JOURNAL_DESC_MAGIC;
+  d->seq = journal_seq;
+  d->cnt = cnt;
+  for (i = 0; i < cnt; i++)
+    d->sectors[i] = slots[i]->sector_idx;
+  checksum = journal_checksum (0, d);
+
+  block_write (fs_device, JOURNAL_SECTOR + 1, d);
+  for (i = 0; i < cnt; i++)
+    {
+      block_write (fs_device, JOURNAL_SECTOR + 2 + i, slots[i]->data);
+      checksum = journal_checksum (checksum, slots[i]->data);
+    }
+
+  memset (c, 0, sizeof *c);
+  c->magic = JOURNAL_COMMIT_MAGIC;
+  c->seq = journal_seq;
+  c->cnt = cnt;
+  c->checksum = checksum;
+  block_write (fs_device, JOURNAL_SECTOR + 2 + cnt, c);
+
+  for (i = 0; i < cnt; i++)
+    block_write (fs_device, slots[i]->sector_idx, slots[i]->data);
+
+  journal_seq++;
+  journal_write_header ();
+}
+
+/* Copies a committed but unretired transaction, if there is one,
+   to its home sectors.  Returns false if the disk has no journal,
+   in which case the sectors where it would be may hold files. */
+static bool
+journal_replay (void)
+{
+  struct journal_descriptor *d = &journal_descriptor;
+  struct journal_commit_record *c = &journal_commit_record;
+  block_sector_t size = block_size (fs_device);
+  uint32_t checksum;
+  void *buffer;
+  uint32_t i;
+
+  block_read (fs_device, JOURNAL_SECTOR, &journal_header);
+  if (journal_header.magic != JOURNAL_MAGIC)
+    {
+      printf ("journal: not found, metadata will not be journaled\n");
+      return false;
+    }
+  journal_seq = journal_header.seq;
+
+  block_read (fs_device, JOURNAL_SECTOR + 1, d);
+  if (d->magic != JOURNAL_DESC_MAGIC || d->seq != journal_seq
+      || d->cnt == 0 || d->cnt > JOURNAL_BLOCKS_MAX)
+    return true;
+  for (i = 0; i < d->cnt; i++)
+    if (d->sectors[i] >= size
+        || (d->sectors[i] >= JOURNAL_SECTOR
+            && d->sectors[i] < JOURNAL_SECTOR + JOURNAL_SECTORS))
+      return true;
+
+  block_read (fs_device, JOURNAL_SECTOR + 2 + d->cnt, c);
+  if (c->magic != JOURNAL_COMMIT_MAGIC || c->seq != d->seq || c->cnt != d->cnt)
+    return true;
+
+  buffer = malloc (BLOCK_SECTOR_SIZE);
+  if (buffer == NULL)
+    PANIC ("can't allocate journal replay buffer");
+
+  checksum = journal_checksum (0, d);
+  for (i = 0; i < d->cnt; i++)
+    {
+      block_read (fs_device, JOURNAL_SECTOR + 2 + i, buffer);
+      checksum = journal_checksum (checksum, buffer);
+    }
+
+  if (checksum == c->checksum)
+    {
+      for (i = 0; i < d->cnt; i++)
+        {
+          block_read (fs_device, JOURNAL_SECTOR + 2 + i, buffer);
+          block_write (fs_device, d->sectors[i], buffer);
+        }
+      printf ("journal: replayed %u sectors of transaction %u\n",
+              (unsigned) d->cnt, (unsigned) d->seq);
+      journal_seq++;
+      journal_write_header ();
+    }
+
+  free (buffer);
+  return true;
+}
+
+/* Writes the header with the current sequence number. */
+static void
+journal_write_header (void)
+{
+  memset (&journal_header, 0, sizeof journal_header);
+  journal_header.magic = JOURNAL_MAGIC;
+  journal_header.seq = journal_seq;
+  block_write (fs_device, JOURNAL_SECTOR, &journal_header);
+}
+
+/* Folds the sector at SECTOR into checksum SUM and returns the
+   result.  Rotating before each add makes the checksum depend on
+   the order of the words, so that swapped sectors are caught. */
+static uint32_t
+journal_checksum (uint32_t sum, const void *sector)
+{
+  const uint32_t *word = sector;
+  size_t i;
+
+  for (i = 0; i < BLOCK_SECTOR_SIZE / sizeof *word; i++)
+    sum = ((sum << 5) | (sum >> 27)) + word[i];
+  return sum;
+}
@@ -0,0 +1,19 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* The journal occupies this many sectors from JOURNAL_SECTOR on:
+   a header, a descriptor, up to JOURNAL_BLOCKS_MAX logged sectors
+   and a commit record. */
+#define JOURNAL_BLOCKS_MAX 125
+#define JOURNAL_SECTORS (JOURNAL_BLOCKS_MAX + 3)
+
+void journal_init (bool format);
+bool journal_active (void);
+void journal_begin (void);
+void journal_end (void);
+void journal_commit (void);
+
+#endif /* filesys/journal.h */
@@ -214,18 +214,53 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Returns an elem_type where the bits of element IDX that lie
+   between bits START and END, exclusive, are turned on.  The
+   range must not be empty. */
+static inline elem_type
+range_mask (size_t idx, size_t start, size_t end)
+{
+  size_t first = idx == elem_idx (start) ? start % ELEM_BITS : 0;
+  size_t last = idx == elem_idx (end - 1) ? (end - 1) % ELEM_BITS : ELEM_BITS - 1;
+  elem_type high = last + 1 < ELEM_BITS
+                   ? ((elem_type) 1 << (last + 1)) - 1 : (elem_type) -1;
+
+  return high & ~(((elem_type) 1 << first) - 1);
+}
+
+/* Returns the number of bits set in WORD, which is 32 bits wide
+   on the 80x86.  Counted by hand, since the compiler's popcount
+   builtin calls into libgcc, which the kernel is not linked
+   with. */
+static inline size_t
+popcount (elem_type word)
+{
+  word = word - ((word >> 1) & 0x55555555);
+  word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+  word = (word + (word >> 4)) & 0x0f0f0f0f;
+  return (word * 0x01010101) >> 24;
+}
+
+/* Sets the CNT bits starting at START in B to VALUE, a whole
+   element at a time.  Each element is updated atomically. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
+  size_t idx, end = start + cnt;
+  elem_type mask;
+
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  for (idx = elem_idx (start); cnt > 0 && idx <= elem_idx (end - 1); idx++)
+    {
+      mask = range_mask (idx, start, end);
+      if (value)
+        asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+      else
+        asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+    }
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -233,16 +268,15 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i, value_cnt;
+  size_t idx, end = start + cnt, value_cnt = 0;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
+  for (idx = elem_idx (start); cnt > 0 && idx <= elem_idx (end - 1); idx++)
+    value_cnt += popcount ((value ? b->bits[idx] : ~b->bits[idx])
+                           & range_mask (idx, start, end));
   return value_cnt;
 }
 
@@ -251,14 +285,14 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
+  size_t idx, end = start + cnt;
+
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
+  for (idx = elem_idx (start); cnt > 0 && idx <= elem_idx (end - 1); idx++)
+    if (((value ? b->bits[idx] : ~b->bits[idx]) & range_mask (idx, start, end)) != 0)
       return true;
   return false;
 }
@@ -289,23 +323,75 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 
 /* Finding set or unset bits. */
 
+/* Returns the index of the first bit in B at or after START and
+   before END that is set to VALUE, or END if there is none.
+   Elements holding no such bit are passed over whole. */
+static size_t
+find_next (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  size_t idx, last;
+  elem_type word;
+  size_t bit;
+
+  if (start >= end)
+    return end;
+
+  idx = elem_idx (start);
+  last = elem_idx (end - 1);
+  word = (value ? b->bits[idx] : ~b->bits[idx])
+         & ~(((elem_type) 1 << (start % ELEM_BITS)) - 1);
+  while (word == 0)
+    {
+      if (++idx > last)
+        return end;
+      word = value ? b->bits[idx] : ~b->bits[idx];
+    }
+
+  bit = idx * ELEM_BITS + __builtin_ctzl (word);
+  return bit < end ? bit : end;
+}
+
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+   The search hops from one run of VALUE bits to the next, so it
+   looks at each element about once. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt > b->bit_cnt)
+    return BITMAP_ERROR;
+  return bitmap_scan_range (b, start, b->bit_cnt, cnt, value);
+}
+
+/* Like bitmap_scan(), but the group must also end at or before
+   END, and no bit at or after END is looked at. */
+size_t
+bitmap_scan_range (const struct bitmap *b, size_t start, size_t end,
+                   size_t cnt, bool value)
+{
+  size_t first, stop;
+
+  ASSERT (b != NULL);
+  ASSERT (start <= end);
+  ASSERT (end <= b->bit_cnt);
+
+  if (cnt == 0)
+    return start;
+
+  while (cnt <= end - start)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      first = find_next (b, start, end, value);
+      if (cnt > end - first)
+        break;
+      stop = find_next (b, first, first + cnt, !value);
+      if (stop - first >= cnt)
+        return first;
+      start = stop;
     }
   return BITMAP_ERROR;
 }
@@ -363,6 +449,24 @@ bitmap_write (const struct bitmap *b, struct file *file)
 
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the SIZE bytes of B that start at byte OFS to the same
+   place in FILE, leaving the rest of FILE alone.  Bytes past the
+   end of B are not written.  Returns true if successful, false
+   otherwise. */
+bool
+bitmap_write_partial (const struct bitmap *b, struct file *file,
+                      size_t ofs, size_t size)
+{
+  size_t total = byte_cnt (b->bit_cnt);
+
+  if (ofs >= total)
+    return true;
+  if (size > total - ofs)
+    size = total - ofs;
+  return file_write_at (file, (const uint8_t *) b->bits + ofs, size, ofs)
+         == (off_t) size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -28,7 +28,18 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Extensions. */
+    SYS_CACHESTAT,              /* Reports buffer cache statistics. */
+    SYS_FSYNC,                  /* Writes a file's data and metadata. */
+    SYS_FDATASYNC,              /* Writes a file's data. */
+    SYS_SYNC,                   /* Writes everything. */
+    SYS_PREAD,                  /* Read from a file at a given offset. */
+    SYS_PWRITE,                 /* Write to a file at a given offset. */
+    SYS_READV,                  /* Read from a file into several buffers. */
+    SYS_WRITEV,                 /* Write several buffers to a file. */
+    SYS_COPY_FILE               /* Copy data from one file to another. */
   };
 
 #endif /* lib/syscall-nr.h */
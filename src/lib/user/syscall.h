@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <iovec.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -15,6 +16,25 @@ typedef int mapid_t;
 /* Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
+/* Buffer cache statistics returned by cachestat(). */
+struct cachestat
+  {
+    unsigned long long hits;            /* Sector lookups served from cache. */
+    unsigned long long misses;          /* Sector lookups that went to disk. */
+    unsigned long long evictions;       /* Cached sectors replaced. */
+    unsigned long long periodic_writes; /* Dirty sectors flushed in background. */
+    unsigned long long eviction_writes; /* Dirty sectors written on eviction. */
+    unsigned long long sync_writes;     /* Dirty sectors written by fsync. */
+    unsigned long long lock_waits;      /* Contended cache lock acquires. */
+    unsigned long long lock_wait_ticks; /* Timer ticks spent waiting. */
+    unsigned long long data_hits;       /* Hits broken down by contents. */
+    unsigned long long inode_hits;
+    unsigned long long indirect_hits;
+    unsigned long long dir_hits;
+    unsigned long long free_map_hits;
+    unsigned long long dirty;           /* Dirty sectors in the cache now. */
+  };
+
 /* Typical return values from main() and arguments to exit(). */
 #define EXIT_SUCCESS 0          /* Successful execution. */
 #define EXIT_FAILURE 1          /* Unsuccessful execution. */
@@ -45,4 +65,15 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Extensions. */
+bool cachestat (struct cachestat *);
+bool fsync (int fd);
+bool fdatasync (int fd);
+void sync (void);
+int pread (int fd, void *buffer, unsigned length, unsigned offset);
+int pwrite (int fd, const void *buffer, unsigned length, unsigned offset);
+int readv (int fd, const struct iovec *iov, int iovcnt);
+int writev (int fd, const struct iovec *iov, int iovcnt);
+int copy_file (int in_fd, int out_fd, unsigned length);
+
 #endif /* lib/user/syscall.h */
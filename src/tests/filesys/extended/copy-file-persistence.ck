@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($a) = random_bytes (9876);
+substr ($a, 1000, 3000) = "\0" x 3000;
+check_archive ({"a" => [$a], "b" => [$a]});
+pass;
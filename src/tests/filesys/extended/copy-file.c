@@ -0,0 +1,62 @@
+/* Copies a file with a hole in it to a new file with copy_file(),
+   in uneven pieces, and checks that both positions advanced and
+   that the copy is correct, hole included. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HOLE_OFS 1000
+#define HOLE_SIZE 3000
+#define FILE_SIZE 9876
+static char buf[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  int in_fd, out_fd;
+  size_t ofs = 0;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+  memset (buf + HOLE_OFS, 0, HOLE_SIZE);
+
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK ((in_fd = open ("a")) > 1, "open \"a\"");
+  CHECK (write (in_fd, buf, HOLE_OFS) == HOLE_OFS, "write \"a\" before hole");
+  seek (in_fd, HOLE_OFS + HOLE_SIZE);
+  CHECK (write (in_fd, buf + HOLE_OFS + HOLE_SIZE,
+                FILE_SIZE - HOLE_OFS - HOLE_SIZE)
+         == FILE_SIZE - HOLE_OFS - HOLE_SIZE, "write \"a\" after hole");
+  seek (in_fd, 0);
+
+  CHECK (create ("b", 0), "create \"b\"");
+  CHECK ((out_fd = open ("b")) > 1, "open \"b\"");
+
+  msg ("copy \"a\" to \"b\"");
+  while (ofs < FILE_SIZE)
+    {
+      size_t block_size = random_ulong () % 1500 + 1;
+      int ret_val = copy_file (in_fd, out_fd, block_size);
+      size_t expected = block_size < FILE_SIZE - ofs ? block_size : FILE_SIZE - ofs;
+
+      if (ret_val != (int) expected)
+        fail ("copy_file of %zu bytes at offset %zu returned %d",
+              block_size, ofs, ret_val);
+      ofs += expected;
+      if (tell (in_fd) != ofs || tell (out_fd) != ofs)
+        fail ("positions are %u and %u after copying %zu bytes",
+              tell (in_fd), tell (out_fd), ofs);
+    }
+  CHECK (copy_file (in_fd, out_fd, 100) == 0, "copy_file at end of \"a\"");
+
+  msg ("close \"a\"");
+  close (in_fd);
+  msg ("close \"b\"");
+  close (out_fd);
+
+  check_file ("a", buf, FILE_SIZE);
+  check_file ("b", buf, FILE_SIZE);
+}
@@ -0,0 +1,25 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(copy-file) begin
+(copy-file) create "a"
+(copy-file) open "a"
+(copy-file) write "a" before hole
+(copy-file) write "a" after hole
+(copy-file) create "b"
+(copy-file) open "b"
+(copy-file) copy "a" to "b"
+(copy-file) copy_file at end of "a"
+(copy-file) close "a"
+(copy-file) close "b"
+(copy-file) open "a" for verification
+(copy-file) verified contents of "a"
+(copy-file) close "a"
+(copy-file) open "b" for verification
+(copy-file) verified contents of "b"
+(copy-file) close "b"
+(copy-file) end
+EOF
+pass;
@@ -0,0 +1,60 @@
+/* Fills a file back to front with pwrite(), reads it back with
+   pread() in a different order, and checks that neither call moved
+   the file position and that the contents are correct. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define BLOCK_SIZE 431
+#define BLOCK_CNT 17
+#define FILE_SIZE (BLOCK_SIZE * BLOCK_CNT)
+static char buf[FILE_SIZE];
+static char check[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "a";
+  int fd, i;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+
+  msg ("pwrite \"%s\" back to front", file_name);
+  for (i = BLOCK_CNT - 1; i >= 0; i--)
+    {
+      int ofs = i * BLOCK_SIZE;
+      int ret_val = pwrite (fd, buf + ofs, BLOCK_SIZE, ofs);
+      if (ret_val != BLOCK_SIZE)
+        fail ("pwrite %d bytes at offset %d in \"%s\" returned %d",
+              BLOCK_SIZE, ofs, file_name, ret_val);
+    }
+  if (tell (fd) != 0)
+    fail ("file position is %u after pwrite", tell (fd));
+
+  msg ("pread \"%s\" odd blocks, then even blocks", file_name);
+  for (i = 1; i < 2 * BLOCK_CNT; i += 2)
+    {
+      int ofs = (i % BLOCK_CNT) * BLOCK_SIZE;
+      int ret_val = pread (fd, check + ofs, BLOCK_SIZE, ofs);
+      if (ret_val != BLOCK_SIZE)
+        fail ("pread %d bytes at offset %d in \"%s\" returned %d",
+              BLOCK_SIZE, ofs, file_name, ret_val);
+    }
+  if (tell (fd) != 0)
+    fail ("file position is %u after pread", tell (fd));
+  compare_bytes (check, buf, FILE_SIZE, 0, file_name);
+
+  CHECK (pread (fd, check, BLOCK_SIZE, FILE_SIZE) == 0,
+         "pread at end of \"%s\"", file_name);
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  check_file (file_name, buf, FILE_SIZE);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(pread-pwrite) begin
+(pread-pwrite) create "a"
+(pread-pwrite) open "a"
+(pread-pwrite) pwrite "a" back to front
+(pread-pwrite) pread "a" odd blocks, then even blocks
+(pread-pwrite) pread at end of "a"
+(pread-pwrite) close "a"
+(pread-pwrite) open "a" for verification
+(pread-pwrite) verified contents of "a"
+(pread-pwrite) close "a"
+(pread-pwrite) end
+EOF
+pass;
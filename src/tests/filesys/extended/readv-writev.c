@@ -0,0 +1,72 @@
+/* Writes records made of a header, a payload and a trailer with
+   one writev() each, reads them back with one readv() split at
+   different places, whose last buffer runs past end of file, and
+   checks that the contents are correct. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HEADER_SIZE 16
+#define PAYLOAD_SIZE 777
+#define TRAILER_SIZE 4
+#define RECORD_SIZE (HEADER_SIZE + PAYLOAD_SIZE + TRAILER_SIZE)
+#define RECORD_CNT 9
+#define FILE_SIZE (RECORD_SIZE * RECORD_CNT)
+static char buf[FILE_SIZE];
+static char check[FILE_SIZE + RECORD_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "a";
+  struct iovec iov[3];
+  int fd, i, ret_val;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+
+  msg ("writev %d records to \"%s\"", RECORD_CNT, file_name);
+  for (i = 0; i < RECORD_CNT; i++)
+    {
+      char *record = buf + i * RECORD_SIZE;
+
+      iov[0].iov_base = record;
+      iov[0].iov_len = HEADER_SIZE;
+      iov[1].iov_base = record + HEADER_SIZE;
+      iov[1].iov_len = PAYLOAD_SIZE;
+      iov[2].iov_base = record + HEADER_SIZE + PAYLOAD_SIZE;
+      iov[2].iov_len = TRAILER_SIZE;
+      ret_val = writev (fd, iov, 3);
+      if (ret_val != RECORD_SIZE)
+        fail ("writev of record %d to \"%s\" returned %d",
+              i, file_name, ret_val);
+    }
+  if (tell (fd) != FILE_SIZE)
+    fail ("file position is %u after writev", tell (fd));
+
+  msg ("readv \"%s\" in three pieces", file_name);
+  seek (fd, 0);
+  iov[0].iov_base = check;
+  iov[0].iov_len = 1;
+  iov[1].iov_base = check + 1;
+  iov[1].iov_len = FILE_SIZE / 2;
+  iov[2].iov_base = check + 1 + FILE_SIZE / 2;
+  iov[2].iov_len = FILE_SIZE - 1 - FILE_SIZE / 2 + RECORD_SIZE;
+  ret_val = readv (fd, iov, 3);
+  if (ret_val != FILE_SIZE)
+    fail ("readv of \"%s\" returned %d", file_name, ret_val);
+  compare_bytes (check, buf, FILE_SIZE, 0, file_name);
+
+  CHECK (readv (fd, iov, 3) == 0, "readv at end of \"%s\"", file_name);
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  check_file (file_name, buf, FILE_SIZE);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(readv-writev) begin
+(readv-writev) create "a"
+(readv-writev) open "a"
+(readv-writev) writev 9 records to "a"
+(readv-writev) readv "a" in three pieces
+(readv-writev) readv at end of "a"
+(readv-writev) close "a"
+(readv-writev) open "a" for verification
+(readv-writev) verified contents of "a"
+(readv-writev) close "a"
+(readv-writev) end
+EOF
+pass;
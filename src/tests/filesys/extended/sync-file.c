@@ -0,0 +1,46 @@
+/* Writes a file in two halves, calling fdatasync() after the first
+   and fsync() after the second, then sync(), and checks that the
+   contents are correct and that sync() left no dirty sector in the
+   buffer cache.  Whether the data survives a reboot is checked by
+   the persistence test; a crash in between cannot be simulated. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 5678
+static char buf[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "a";
+  size_t half = FILE_SIZE / 2;
+  struct cachestat st;
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+
+  CHECK (write (fd, buf, half) == (int) half,
+         "write %zu bytes to \"%s\"", half, file_name);
+  CHECK (fdatasync (fd), "fdatasync \"%s\"", file_name);
+  CHECK (write (fd, buf + half, FILE_SIZE - half) == (int) (FILE_SIZE - half),
+         "write %zu bytes to \"%s\"", FILE_SIZE - half, file_name);
+  CHECK (fsync (fd), "fsync \"%s\"", file_name);
+
+  msg ("sync");
+  sync ();
+  CHECK (cachestat (&st), "cachestat");
+  if (st.dirty != 0)
+    fail ("%llu dirty sectors after sync", st.dirty);
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  check_file (file_name, buf, FILE_SIZE);
+}
@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(sync-file) begin
+(sync-file) create "a"
+(sync-file) open "a"
+(sync-file) write 2839 bytes to "a"
+(sync-file) fdatasync "a"
+(sync-file) write 2839 bytes to "a"
+(sync-file) fsync "a"
+(sync-file) sync
+(sync-file) cachestat
+(sync-file) close "a"
+(sync-file) open "a" for verification
+(sync-file) verified contents of "a"
+(sync-file) close "a"
+(sync-file) end
+EOF
+pass;
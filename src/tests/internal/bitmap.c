@@ -0,0 +1,205 @@
+/* Test program for lib/kernel/bitmap.c.
+
+   Checks bitmap_scan(), bitmap_scan_range(), bitmap_count() and
+   bitmap_contains(), which work a whole element at a time, against
+   the obvious versions that test one bit at a time, and times both
+   on a nearly full bitmap like the one a busy free map becomes.
+   Then checks that bitmap_write_partial() writes exactly the bytes
+   it is asked to, through a scratch file in the file system.
+
+   Run it with the `bitmap-test' action.  A mismatch fails an
+   assertion; success prints "bitmap: PASS".
+*/
+
+#undef NDEBUG
+#include "tests/internal/tests.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+
+/* Number of bits in the bitmaps we test and time. */
+#define BIT_CNT 8192
+
+/* Number of scans to time. */
+#define SCAN_CNT 200
+
+/* Number of partial writes to check. */
+#define WRITE_CNT 50
+
+static size_t slow_scan (const struct bitmap *, size_t start, size_t end,
+                         size_t cnt, bool value);
+static size_t slow_count (const struct bitmap *, size_t start, size_t cnt,
+                          bool value);
+static void fill (struct bitmap *, int percent_set);
+static void copy (struct bitmap *dst, const struct bitmap *src);
+static void test_write_partial (struct bitmap *);
+
+/* Tests the bitmap implementation. */
+void
+test_bitmap (void)
+{
+  struct bitmap *b = bitmap_create (BIT_CNT);
+  int64_t start_ticks, slow_ticks, fast_ticks;
+  int percent, i;
+
+  ASSERT (b != NULL);
+
+  printf ("testing various fill levels:");
+  for (percent = 0; percent <= 100; percent += 10)
+    {
+      printf (" %d%%", percent);
+      fill (b, percent);
+      for (i = 0; i < 1000; i++)
+        {
+          size_t start = random_ulong () % BIT_CNT;
+          size_t cnt = random_ulong () % 8;
+          size_t len = random_ulong () % (BIT_CNT - start + 1);
+          bool value = random_ulong () % 2;
+
+          ASSERT (bitmap_scan (b, start, cnt, value)
+                  == slow_scan (b, start, BIT_CNT, cnt, value));
+          ASSERT (bitmap_scan_range (b, start, start + len, cnt, value)
+                  == slow_scan (b, start, start + len, cnt, value));
+          ASSERT (bitmap_count (b, start, len, value)
+                  == slow_count (b, start, len, value));
+          ASSERT (bitmap_contains (b, start, len, value)
+                  == (slow_count (b, start, len, value) > 0));
+        }
+    }
+  printf (" done\n");
+
+  /* Time scans for a run of free bits in a bitmap that is nearly
+     all set, with the free bits near the end. */
+  bitmap_set_all (b, true);
+  bitmap_set_multiple (b, BIT_CNT - 64, 32, false);
+
+  start_ticks = timer_ticks ();
+  for (i = 0; i < SCAN_CNT; i++)
+    ASSERT (slow_scan (b, 0, BIT_CNT, 16, false) == BIT_CNT - 64);
+  slow_ticks = timer_elapsed (start_ticks);
+
+  start_ticks = timer_ticks ();
+  for (i = 0; i < SCAN_CNT; i++)
+    ASSERT (bitmap_scan (b, 0, 16, false) == BIT_CNT - 64);
+  fast_ticks = timer_elapsed (start_ticks);
+
+  printf ("%d scans of %d bits: bit at a time %lld ticks, "
+          "word at a time %lld ticks\n",
+          SCAN_CNT, BIT_CNT, slow_ticks, fast_ticks);
+
+  test_write_partial (b);
+
+  bitmap_destroy (b);
+  printf ("bitmap: PASS\n");
+}
+
+/* Writes B to a scratch file, then repeatedly changes B at random
+   and writes a random byte range of it back with
+   bitmap_write_partial(), and checks that the file holds the new
+   bits in that range and the old ones everywhere else. */
+static void
+test_write_partial (struct bitmap *b)
+{
+  const char *name = "bitmap-test";
+  size_t bytes = bitmap_file_size (b);
+  struct bitmap *old = bitmap_create (BIT_CNT);
+  struct bitmap *disk = bitmap_create (BIT_CNT);
+  struct file *file;
+  size_t i;
+  int k;
+
+  ASSERT (old != NULL && disk != NULL);
+  ASSERT (filesys_create (name, bytes));
+  file = filesys_open (name);
+  ASSERT (file != NULL);
+
+  printf ("testing partial writes:");
+  fill (b, 50);
+  ASSERT (bitmap_write (b, file));
+  for (k = 0; k < WRITE_CNT; k++)
+    {
+      /* Ranges may run past the end of B, which must be cut off. */
+      size_t ofs = random_ulong () % (bytes + 8);
+      size_t size = random_ulong () % (bytes / 4);
+
+      copy (old, b);
+      fill (b, 50);
+      ASSERT (bitmap_write_partial (b, file, ofs, size));
+      ASSERT (bitmap_read (disk, file));
+      for (i = 0; i < BIT_CNT; i++)
+        {
+          bool in_range = i / 8 >= ofs && i / 8 < ofs + size;
+          ASSERT (bitmap_test (disk, i)
+                  == bitmap_test (in_range ? b : old, i));
+        }
+      /* Bring the file in line with B for the next round. */
+      ASSERT (bitmap_write (b, file));
+    }
+  printf (" done\n");
+
+  file_close (file);
+  ASSERT (filesys_remove (name));
+  bitmap_destroy (old);
+  bitmap_destroy (disk);
+}
+
+/* bitmap_scan_range() as bitmap_scan() was written before, testing
+   one bit at a time. */
+static size_t
+slow_scan (const struct bitmap *b, size_t start, size_t end, size_t cnt,
+           bool value)
+{
+  if (cnt <= end - start)
+    {
+      size_t last = end - cnt;
+      size_t i, j;
+
+      for (i = start; i <= last; i++)
+        {
+          for (j = 0; j < cnt; j++)
+            if (bitmap_test (b, i + j) != value)
+              break;
+          if (j == cnt)
+            return i;
+        }
+    }
+  return BITMAP_ERROR;
+}
+
+/* bitmap_count() as it was written before, testing one bit at a
+   time. */
+static size_t
+slow_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, value_cnt = 0;
+
+  for (i = 0; i < cnt; i++)
+    if (bitmap_test (b, start + i) == value)
+      value_cnt++;
+  return value_cnt;
+}
+
+/* Sets about PERCENT_SET percent of the bits in B, at random, and
+   clears the rest. */
+static void
+fill (struct bitmap *b, int percent_set)
+{
+  size_t i;
+
+  for (i = 0; i < bitmap_size (b); i++)
+    bitmap_set (b, i, (int) (random_ulong () % 100) < percent_set);
+}
+
+/* Copies SRC, which has as many bits as DST, into DST. */
+static void
+copy (struct bitmap *dst, const struct bitmap *src)
+{
+  size_t i;
+
+  for (i = 0; i < bitmap_size (src); i++)
+    bitmap_set (dst, i, bitmap_test (src, i));
+}
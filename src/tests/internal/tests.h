@@ -0,0 +1,7 @@
+#ifndef TESTS_INTERNAL_TESTS_H
+#define TESTS_INTERNAL_TESTS_H
+
+/* Tests of kernel library code, run by kernel actions. */
+void test_bitmap (void);
+
+#endif /* tests/internal/tests.h */
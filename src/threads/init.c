@@ -37,6 +37,7 @@
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #include "filesys/cache.h"
+#include "tests/internal/tests.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -254,6 +255,12 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        {
+          if (value == NULL || atoi (value) <= 0)
+            PANIC ("-cache needs a positive number of sectors");
+          buffer_cache_configure (atoi (value));
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -299,6 +306,15 @@ run_task (char **argv)
   printf ("Execution of '%s' complete.\n", task);
 }
 
+#ifdef FILESYS
+/* Runs the bitmap tests. */
+static void
+run_bitmap_test (char **argv UNUSED)
+{
+  test_bitmap ();
+}
+#endif
+
 /* Executes all of the actions specified in ARGV[]
    up to the null pointer sentinel. */
 static void
@@ -322,12 +338,14 @@ run_actions (char **argv)
       {"rm", 2, fsutil_rm},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
+      {"bitmap-test", 1, run_bitmap_test},
 #endif
       {NULL, 0, NULL},
     };
 
 #ifdef FILESYS
 	run_dirty_buffer_cache_writer();	
+	run_read_ahead_buffer_cache();
 #endif 
 
   while (*argv != NULL)
@@ -377,6 +395,7 @@ usage (void)
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  extract            Untar from scratch device into file system.\n"
           "  append FILE        Append FILE to tar file on scratch device.\n"
+          "  bitmap-test        Check and time the bitmap code.\n"
 #endif
           "\nOptions:\n"
           "  -h                 Print this help message and power off.\n"
@@ -386,6 +405,7 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=SECTORS     Size the buffer cache to SECTORS sectors.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -132,6 +132,7 @@ struct thread
 
 		block_sector_t cwd_sector;
 		bool cwd_is_removed;	
+		int journal_depth;                  /* Nested journal_begin() calls. */
 
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
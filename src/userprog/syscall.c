@@ -4,6 +4,7 @@
 #include "filesys/filesys.h"
 #include "filesys/file.h"
 #include "filesys/directory.h"
+#include "filesys/cache.h"
 #include <stdio.h>
 #include <string.h>
 #include <syscall-nr.h>
@@ -14,9 +15,12 @@
 #include "threads/synch.h"
 #include "lib/user/syscall.h"
 #include "lib/string.h"
+#include "lib/kernel/stdio.h"
 #include "devices/input.h"
 
 static void syscall_handler (struct intr_frame *);
+static struct iovec* copy_in_iovec(struct thread*, const struct iovec*, int);
+static int read_stdin(void*, int);
 static struct semaphore sysSema;
 
 void
@@ -35,6 +39,66 @@ check_ptr_invalidity(struct thread* t, void* ptr){
 	return false;
 }
 
+/* Returns true unless every page of the SIZE bytes at PTR is a
+   mapped user page. */
+bool
+check_buffer_invalidity(struct thread* t, const void* ptr, size_t size){
+	const uint8_t* p = ptr;
+	const uint8_t* last;
+
+	if (size == 0)
+		return false;
+	last = p + size - 1;
+	if (last < p)
+		return true;
+	for (p = pg_round_down(p); p <= last; p += PGSIZE)
+		if (check_ptr_invalidity(t, (void*)p))
+			return true;
+	return false;
+}
+
+/* Copies the IOVCNT buffer descriptors at user address IOV into a
+   new kernel array, after checking that the array and every buffer
+   are mapped, so that they are validated once and cannot change
+   underneath the file system.  Returns a null pointer if IOVCNT is
+   out of range or memory runs out; kills the process on a bad
+   pointer.  The caller frees the array. */
+static struct iovec*
+copy_in_iovec(struct thread* t, const struct iovec* iov, int iovcnt){
+	struct iovec* kiov;
+	int i;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return NULL;
+	if (check_buffer_invalidity(t, iov, sizeof *iov * iovcnt))
+		exit_unexpectedly(t);
+
+	kiov = malloc(sizeof *kiov * (iovcnt > 0 ? iovcnt : 1));
+	if (kiov == NULL)
+		return NULL;
+	memcpy(kiov, iov, sizeof *kiov * iovcnt);
+
+	for (i = 0; i < iovcnt; i++)
+		if ((off_t) kiov[i].iov_len < 0
+				|| check_buffer_invalidity(t, kiov[i].iov_base, kiov[i].iov_len)) {
+			free(kiov);
+			exit_unexpectedly(t);
+		}
+	return kiov;
+}
+
+/* Reads SIZE bytes typed at the keyboard into BUFFER, which the
+   caller has checked, and returns SIZE. */
+static int
+read_stdin(void* buffer, int size){
+	uint8_t* p = buffer;
+	int i;
+
+	for (i = 0; i < size; i++)
+		p[i] = input_getc();
+	return size;
+}
+
 void
 exit_unexpectedly(struct thread* t){
 			sema_down(&sysSema);
@@ -75,6 +139,11 @@ syscall_handler (struct intr_frame *f)
 	char* fileName=NULL;
 	int fileInitSize=0;
 	int fileSize=0;
+	int fileOffset=0;
+	struct iovec* iov=NULL;
+	struct file* outFile=NULL;
+	int iovCnt=0;
+	int i;
 	int fd=0;
 	struct file* file=NULL;	
 	char* fileBuffer=NULL;
@@ -83,6 +152,8 @@ syscall_handler (struct intr_frame *f)
 	int execPid=0;
 	int waitPid=0;
 	struct dir* dir=NULL;
+	struct cachestat* cstat=NULL;
+	struct buffer_cache_stats bcstat;
 
 	switch(syscallNum){
 		case SYS_HALT:
@@ -162,6 +233,15 @@ syscall_handler (struct intr_frame *f)
 				break;
 			}
 
+			if (fd == 0){
+				if (fileSize < 0 || check_buffer_invalidity(t, fileBuffer, fileSize)){
+					exit_unexpectedly(t);
+					return;
+				}
+				f->eax = read_stdin(fileBuffer, fileSize);
+				break;
+			}
+
 			file = thread_open_fd(fd);
 			if (file==NULL){
 				exit_unexpectedly(t);
@@ -316,6 +396,145 @@ syscall_handler (struct intr_frame *f)
 			printf("SYS_READDIR will be called; dir %p, fileName %s, fd %d\n", dir, fileName, fd);
 #endif
 			f->eax=dir_readdir(dir, fileName);
+			break;
+
+		case SYS_CACHESTAT:
+			cstat = (struct cachestat*)*(espP+1);
+			if (check_ptr_invalidity(t, cstat) || check_ptr_invalidity(t, (char*)(cstat+1)-1)){
+				exit_unexpectedly(t);
+				return;
+			}
+
+			get_buffer_cache_stats(&bcstat);
+			cstat->hits = bcstat.hits;
+			cstat->misses = bcstat.misses;
+			cstat->evictions = bcstat.evictions;
+			cstat->periodic_writes = bcstat.periodic_writes;
+			cstat->eviction_writes = bcstat.eviction_writes;
+			cstat->sync_writes = bcstat.sync_writes;
+			cstat->lock_waits = bcstat.lock_waits;
+			cstat->lock_wait_ticks = bcstat.lock_wait_ticks;
+			cstat->data_hits = bcstat.class_hits[BC_CLASS_DATA];
+			cstat->inode_hits = bcstat.class_hits[BC_CLASS_INODE];
+			cstat->indirect_hits = bcstat.class_hits[BC_CLASS_INDIRECT];
+			cstat->dir_hits = bcstat.class_hits[BC_CLASS_DIR];
+			cstat->free_map_hits = bcstat.class_hits[BC_CLASS_FREE_MAP];
+			cstat->dirty = bcstat.dirty;
+			f->eax=true;
+			break;
+
+		case SYS_FSYNC:
+		case SYS_FDATASYNC:
+			fd = *(espP+1);
+
+			file = thread_open_fd(fd);
+			if (file==NULL){
+				exit_unexpectedly(t);
+				return;
+			}
+
+			f->eax=file_sync(file, syscallNum == SYS_FDATASYNC);
+			break;
+
+		case SYS_SYNC:
+			write_dirty_buffer_cache_to_sector();
+			break;
+
+		case SYS_PREAD:
+		case SYS_PWRITE:
+			fd = *(espP+1);
+			fileBuffer = (char*)*(espP+2);
+			fileSize = *(espP+3);
+			fileOffset = *(espP+4);
+
+			if(check_ptr_invalidity(t,fileBuffer)){
+				exit_unexpectedly(t);
+				return;
+			}
+
+			file = thread_open_fd(fd);
+			if (file==NULL){
+				exit_unexpectedly(t);
+				return;
+			}
+
+			if (fileOffset < 0){
+				f->eax=-1;
+				break;
+			}
+
+			/* Neither call touches the file position. */
+			if (syscallNum == SYS_PREAD)
+				f->eax = file_read_at(file, (void*)fileBuffer, fileSize, fileOffset);
+			else if (file_is_dir(file)){
+				exit_unexpectedly(t);
+				return;
+			}
+			else
+				f->eax = file_write_at(file, fileBuffer, fileSize, fileOffset);
+			break;
+
+		case SYS_READV:
+		case SYS_WRITEV:
+			fd = *(espP+1);
+			iovCnt = *(espP+3);
+
+			iov = copy_in_iovec(t, (const struct iovec*)*(espP+2), iovCnt);
+			if (iov == NULL){
+				f->eax=-1;
+				break;
+			}
+
+			if (fd == 1 && syscallNum == SYS_WRITEV){
+				f->eax=0;
+				for (i = 0; i < iovCnt; i++){
+					putbuf(iov[i].iov_base, iov[i].iov_len);
+					f->eax += iov[i].iov_len;
+				}
+				free(iov);
+				break;
+			}
+
+			if (fd == 0 && syscallNum == SYS_READV){
+				f->eax=0;
+				for (i = 0; i < iovCnt; i++)
+					f->eax += read_stdin(iov[i].iov_base, iov[i].iov_len);
+				free(iov);
+				break;
+			}
+
+			file = thread_open_fd(fd);
+			if (file==NULL || (syscallNum == SYS_WRITEV && file_is_dir(file))){
+				free(iov);
+				exit_unexpectedly(t);
+				return;
+			}
+
+			if (syscallNum == SYS_READV)
+				f->eax = file_readv(file, iov, iovCnt);
+			else
+				f->eax = file_writev(file, iov, iovCnt);
+			free(iov);
+			break;
+
+		case SYS_COPY_FILE:
+			file = thread_open_fd(*(espP+1));
+			outFile = thread_open_fd(*(espP+2));
+			fileSize = *(espP+3);
+
+			if (file==NULL || outFile==NULL || file_is_dir(file) || file_is_dir(outFile)){
+				exit_unexpectedly(t);
+				return;
+			}
+
+			if (fileSize < 0){
+				f->eax=-1;
+				break;
+			}
+
+			f->eax = file_copy(outFile, file, fileSize);
+			break;
+
 		default:
 			break;
 	}
@@ -4,6 +4,7 @@
 
 void syscall_init (void);
 bool check_ptr_invalidity(struct thread* t, void* ptr);
+bool check_buffer_invalidity(struct thread* t, const void* ptr, size_t size);
 void exit_unexpectedly(struct thread* t);
 void exit_expectedly(struct thread* t, int);
 